@@ -0,0 +1,81 @@
+/* Spin-then-park lock that learns how long to spin.
+
+   Modeled after glibc's PTHREAD_MUTEX_ADAPTIVE_NP: the lock keeps a moving
+   average of the spins its contended acquisitions needed, and lets the next
+   waiter spin up to twice that (plus a little slack) before parking on the
+   futex. Short, frequently handed-off critical sections drive the budget up;
+   long holds or many waiters, where spinning just burns the CPU, make
+   waiters exhaust the budget and park, exactly as ParkingFutex does.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+
+#include "lock-utils.h"
+#include "sys-futex.h"
+
+class AdaptiveFutex {
+   enum {
+      UNLOCKED=0,
+      LOCKED=1,
+      CONTENDED=2
+   };
+
+   // Same as glibc's default for the max adaptive spin count.
+   static constexpr int MAX_SPINS = 100;
+
+   std::atomic<int> m_state{UNLOCKED};
+   // Only written by the owner; relaxed reads by waiters are just a hint.
+   std::atomic<int> m_spins{0};
+
+   bool try_acquire() noexcept {
+      int state = UNLOCKED;
+      return m_state.compare_exchange_strong(state, LOCKED,
+            std::memory_order_acquire,
+            std::memory_order_relaxed);
+   }
+
+   void park() noexcept {
+      int state = m_state.exchange(CONTENDED, std::memory_order_acquire);
+      while (state != UNLOCKED) {
+         futex_wait(m_state, CONTENDED);
+         state = m_state.exchange(CONTENDED, std::memory_order_acquire);
+      }
+   }
+
+public:
+   AdaptiveFutex() {}
+   AdaptiveFutex(const AdaptiveFutex& )= delete;
+   AdaptiveFutex(AdaptiveFutex&& )= delete;
+   ~AdaptiveFutex() {}
+
+   void lock() noexcept {
+      if (try_acquire()) {
+         return;
+      }
+
+      int spins = m_spins.load(std::memory_order_relaxed);
+      int budget = std::min(MAX_SPINS, spins * 2 + 10);
+      int count = 0;
+      for (;;) {
+         if (count++ >= budget) {
+            park();
+            break;
+         }
+         cpu_relax();
+         // Test before test-and-set, so spinners don't steal the line.
+         if (m_state.load(std::memory_order_relaxed) == UNLOCKED && try_acquire()) {
+            break;
+         }
+      }
+      // We own the lock: move the estimate 1/8 of the way towards this sample.
+      m_spins.store(spins + (count - spins) / 8, std::memory_order_relaxed);
+   }
+
+   void unlock() noexcept {
+      if (m_state.exchange(UNLOCKED, std::memory_order_release) != LOCKED) {
+         futex_wake(m_state, 1);
+      }
+   }
+};
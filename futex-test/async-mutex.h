@@ -0,0 +1,251 @@
+/* A mutex for C++20 coroutines: a contended co_await mutex.lock()
+   suspends the coroutine instead of blocking (or spinning) its thread,
+   which is free to run other tasks meanwhile.
+
+   - AsyncMutex: the lock word is NOT_LOCKED, LOCKED (without waiters) or
+     the newest waiter. Waiters push their awaiter, which lives in their
+     coroutine frame, so queueing never allocates. The owner turns the
+     pushed stack into a FIFO queue, and unlock() hands the lock over to
+     the oldest waiter. The waiter is resumed on the ThreadPool it was
+     running on (inline if none): resuming it from within unlock() would
+     nest one resumption per waiter on the unlocking thread's stack.
+   - ThreadPool: a few threads running the coroutines posted to them, in
+     posting order; co_await pool.schedule() moves a coroutine there.
+   - DetachedTask: fire-and-forget coroutine; its frame goes away when it
+     returns. TaskLatch tells when a batch of them is done.
+*/
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "futex-condition.h"
+#include "parking-futex.h"
+#include "sys-futex.h"
+
+
+class ThreadPool {
+   ParkingFutex m_mutex;
+   FutexCondition m_not_empty;
+   std::deque<std::coroutine_handle<>> m_ready;
+   bool m_stop{false};
+   std::vector<std::thread> m_threads;
+
+   static ThreadPool*& current_pool() noexcept {
+      static thread_local ThreadPool* pool = nullptr;
+      return pool;
+   }
+
+public:
+   explicit ThreadPool(int threadCount) {
+      for (int i = 0; i < threadCount; ++i) {
+         m_threads.emplace_back([this]() { run(); });
+      }
+   }
+   ThreadPool(const ThreadPool& )= delete;
+   ThreadPool(ThreadPool&& )= delete;
+
+   // Runs what's already posted, then stops.
+   ~ThreadPool() {
+      {
+         std::lock_guard<ParkingFutex> guard(m_mutex);
+         m_stop = true;
+      }
+      m_not_empty.notify_all();
+      for (auto& thread: m_threads) {
+         thread.join();
+      }
+   }
+
+   // The pool running the calling thread, if any.
+   static ThreadPool* current() noexcept {
+      return current_pool();
+   }
+
+   void post(std::coroutine_handle<> coroutine) {
+      {
+         std::lock_guard<ParkingFutex> guard(m_mutex);
+         m_ready.push_back(coroutine);
+      }
+      m_not_empty.notify_one();
+   }
+
+   auto schedule() noexcept {
+      struct awaiter {
+         ThreadPool& pool;
+         bool await_ready() const noexcept { return false; }
+         void await_suspend(std::coroutine_handle<> coroutine) { pool.post(coroutine); }
+         void await_resume() const noexcept {}
+      };
+      return awaiter{*this};
+   }
+
+private:
+   void run() {
+      current_pool() = this;
+      for (;;) {
+         std::coroutine_handle<> coroutine;
+         {
+            std::unique_lock<ParkingFutex> lock(m_mutex);
+            m_not_empty.wait(lock, [this]() { return m_stop || !m_ready.empty(); });
+            if (m_ready.empty()) {
+               return;
+            }
+            coroutine = m_ready.front();
+            m_ready.pop_front();
+         }
+         coroutine.resume();
+      }
+   }
+};
+
+
+class AsyncMutex {
+public:
+   class lock_operation;
+
+private:
+   // Any other value is the lock_operation* of the newest waiter.
+   static constexpr std::uintptr_t NOT_LOCKED = 1;
+   static constexpr std::uintptr_t LOCKED = 0;
+
+   std::atomic<std::uintptr_t> m_state{NOT_LOCKED};
+   // Oldest first; only touched by the owner.
+   lock_operation* m_waiters{nullptr};
+
+public:
+   class lock_operation {
+      friend class AsyncMutex;
+
+      AsyncMutex& m_mutex;
+      lock_operation* m_next{nullptr};
+      std::coroutine_handle<> m_coroutine;
+      ThreadPool* m_pool{nullptr};
+
+   public:
+      explicit lock_operation(AsyncMutex& mutex) noexcept: m_mutex(mutex) {}
+
+      bool await_ready() const noexcept { return false; }
+
+      // Returns false, so that the coroutine goes on, if it got the lock.
+      bool await_suspend(std::coroutine_handle<> coroutine) noexcept {
+         m_coroutine = coroutine;
+         m_pool = ThreadPool::current();
+         std::uintptr_t state = m_mutex.m_state.load(std::memory_order_acquire);
+         for (;;) {
+            if (state == NOT_LOCKED) {
+               if (m_mutex.m_state.compare_exchange_weak(state, LOCKED,
+                     std::memory_order_acquire,
+                     std::memory_order_relaxed)) {
+                  return false;
+               }
+            }
+            else {
+               m_next = reinterpret_cast<lock_operation*>(state);
+               if (m_mutex.m_state.compare_exchange_weak(state, reinterpret_cast<std::uintptr_t>(this),
+                     std::memory_order_release,
+                     std::memory_order_relaxed)) {
+                  return true;
+               }
+            }
+         }
+      }
+
+      void await_resume() const noexcept {}
+
+   private:
+      void resume() {
+         if (m_pool) {
+            m_pool->post(m_coroutine);
+         }
+         else {
+            m_coroutine.resume();
+         }
+      }
+   };
+
+   AsyncMutex() {}
+   AsyncMutex(const AsyncMutex& )= delete;
+   AsyncMutex(AsyncMutex&& )= delete;
+   ~AsyncMutex() {}
+
+   bool try_lock() noexcept {
+      std::uintptr_t state = NOT_LOCKED;
+      return m_state.compare_exchange_strong(state, LOCKED,
+            std::memory_order_acquire,
+            std::memory_order_relaxed);
+   }
+
+   // co_await mutex.lock(); the caller owns the lock when it resumes.
+   lock_operation lock() noexcept {
+      return lock_operation(*this);
+   }
+
+   void unlock() {
+      lock_operation* next = m_waiters;
+      if (!next) {
+         std::uintptr_t state = LOCKED;
+         if (m_state.compare_exchange_strong(state, NOT_LOCKED,
+               std::memory_order_release,
+               std::memory_order_relaxed)) {
+            return;
+         }
+
+         // Take all the waiters pushed so far, newest first, and reverse them.
+         state = m_state.exchange(LOCKED, std::memory_order_acquire);
+         auto* pushed = reinterpret_cast<lock_operation*>(state);
+         while (pushed) {
+            lock_operation* older = pushed->m_next;
+            pushed->m_next = next;
+            next = pushed;
+            pushed = older;
+         }
+      }
+
+      // The lock stays LOCKED: it now belongs to next.
+      m_waiters = next->m_next;
+      next->resume();
+   }
+};
+
+
+struct DetachedTask {
+   struct promise_type {
+      DetachedTask get_return_object() noexcept { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() noexcept { std::terminate(); }
+   };
+};
+
+
+// Counts down to zero as the tasks finish; wait() blocks until it's there.
+class TaskLatch {
+   std::atomic<int> m_count;
+
+public:
+   explicit TaskLatch(int count) noexcept: m_count(count) {}
+   TaskLatch(const TaskLatch& )= delete;
+   TaskLatch(TaskLatch&& )= delete;
+
+   void count_down() noexcept {
+      if (m_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+         futex_wake(m_count, INT_MAX);
+      }
+   }
+
+   void wait() noexcept {
+      int count;
+      while ((count = m_count.load(std::memory_order_acquire)) != 0) {
+         futex_wait(m_count, count);
+      }
+   }
+};
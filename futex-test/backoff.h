@@ -0,0 +1,149 @@
+/* Waiting strategies for BasicFutex.
+
+   A backoff policy decides what a thread does after a failed attempt to grab
+   the lock. The lock creates one policy object per contended acquisition and
+   calls wait() after each failure, so the policy can keep its own counters.
+
+   Policies needing per-lock bookkeeping (i.e. to know whether unlock has to
+   wake someone) declare it as lock_state; the lock embeds one and calls
+   on_unlock() after each release. BackoffBase provides the no-op defaults.
+
+   Policies that park also have wait_for(), which sleeps no longer than a
+   timeout, for the timed tries. The others only spin or yield, so their
+   wait() comes back soon enough for the lock to check the deadline itself.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "lock-utils.h"
+#include "sys-futex.h"
+
+
+struct BackoffBase {
+   struct lock_state {};
+   static void on_unlock(std::atomic<int>&, lock_state&) noexcept {}
+};
+
+
+// The historical Futex behavior: 0 spins hot, 1 yields after every failed
+// attempt, any other N yields every N failed attempts.
+template<unsigned int spinCount>
+class SpinYieldBackoff: public BackoffBase {
+   unsigned int m_count{spinCount};
+
+public:
+   void wait(std::atomic<int>&, lock_state&) noexcept {
+      if (spinCount == 1) {
+         std::this_thread::yield();
+      }
+      else if (spinCount && --m_count == 0) {
+         std::this_thread::yield();
+         m_count = spinCount;
+      }
+   }
+};
+
+
+// Spins hot, but with the architectural relax hint.
+class PauseBackoff: public BackoffBase {
+public:
+   void wait(std::atomic<int>&, lock_state&) noexcept {
+      cpu_relax();
+   }
+};
+
+
+// Relaxes for a random number of rounds in [1, limit], doubling the limit
+// at each failure up to maxSpins. The jitter keeps waiters that failed
+// together from retrying together.
+template<unsigned int minSpins=4, unsigned int maxSpins=1024>
+class ExponentialBackoff: public BackoffBase {
+   unsigned int m_limit{minSpins};
+   std::uint32_t m_seed;
+
+public:
+   // Stack addresses differ across threads: good enough as a seed.
+   ExponentialBackoff(): m_seed{static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(this) >> 4) | 1} {}
+
+   void wait(std::atomic<int>&, lock_state&) noexcept {
+      // xorshift32
+      m_seed ^= m_seed << 13;
+      m_seed ^= m_seed >> 17;
+      m_seed ^= m_seed << 5;
+
+      unsigned int spins = 1 + m_seed % m_limit;
+      for (unsigned int i = 0; i < spins; ++i) {
+         cpu_relax();
+      }
+      if (m_limit < maxSpins) {
+         m_limit *= 2;
+      }
+   }
+};
+
+
+// Relaxes for spinCount attempts, then yields at every failure.
+template<unsigned int spinCount=0x40>
+class SpinThenYieldBackoff: public BackoffBase {
+   unsigned int m_count{0};
+
+public:
+   void wait(std::atomic<int>&, lock_state&) noexcept {
+      if (m_count < spinCount) {
+         ++m_count;
+         cpu_relax();
+      }
+      else {
+         std::this_thread::yield();
+      }
+   }
+};
+
+
+// Relaxes for spinCount attempts, then sleeps on the lock word. The lock
+// counts the sleepers, so that unlock only pays the wake-up syscall when
+// there's someone to wake.
+template<unsigned int spinCount=0x40>
+class SpinThenParkBackoff {
+   unsigned int m_count{0};
+
+public:
+   struct lock_state {
+      std::atomic<int> waiters{0};
+   };
+
+   void wait(std::atomic<int>& word, lock_state& state) noexcept {
+      if (m_count < spinCount) {
+         ++m_count;
+         cpu_relax();
+         return;
+      }
+      // Either on_unlock sees our increment, or the kernel sees the
+      // released word and doesn't put us to sleep.
+      state.waiters.fetch_add(1, std::memory_order_seq_cst);
+      futex_wait(word, 1);
+      state.waiters.fetch_sub(1, std::memory_order_relaxed);
+   }
+
+   void wait_for(std::atomic<int>& word, lock_state& state, std::chrono::nanoseconds timeout) noexcept {
+      if (m_count < spinCount) {
+         ++m_count;
+         cpu_relax();
+         return;
+      }
+      state.waiters.fetch_add(1, std::memory_order_seq_cst);
+      futex_wait_for(word, 1, timeout);
+      state.waiters.fetch_sub(1, std::memory_order_relaxed);
+   }
+
+   static void on_unlock(std::atomic<int>& word, lock_state& state) noexcept {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (state.waiters.load(std::memory_order_relaxed)) {
+         futex_wake(word, 1);
+      }
+   }
+};
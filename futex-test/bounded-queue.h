@@ -0,0 +1,145 @@
+/* Bounded multi-producer multi-consumer queues, for the pipeline benchmark.
+
+   - LockedRing: a plain ring buffer, every operation under the mutex_type
+     lock, so it carries over whatever the lock does under contention.
+   - MpmcRing: Dmitry Vyukov's lock-free bounded queue. Each cell has a
+     sequence number telling whether it's ready to be written or read for
+     the current lap; producers and consumers claim positions with a CAS on
+     their own counter and only meet on the cells.
+
+   Both only have non-blocking try_push()/try_pop(): what to do when the
+   queue is full or empty is up to the caller. Capacities are rounded up to
+   a power of two.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "lock-utils.h"
+
+
+inline size_t ring_capacity(size_t capacity)
+{
+   size_t rounded = 1;
+   while (rounded < capacity) {
+      rounded <<= 1;
+   }
+   return rounded;
+}
+
+
+template<class T, class mutex_type>
+class LockedRing {
+   mutex_type m_mutex;
+   std::vector<T> m_items;
+   size_t m_mask;
+   size_t m_head{0};
+   size_t m_count{0};
+
+public:
+   explicit LockedRing(size_t capacity):
+      m_items(ring_capacity(capacity)),
+      m_mask(m_items.size() - 1)
+   {}
+   LockedRing(const LockedRing& )= delete;
+   LockedRing(LockedRing&& )= delete;
+
+   bool try_push(const T& item) {
+      std::lock_guard<mutex_type> guard(m_mutex);
+      if (m_count == m_items.size()) {
+         return false;
+      }
+      m_items[(m_head + m_count) & m_mask] = item;
+      ++m_count;
+      return true;
+   }
+
+   bool try_pop(T& item) {
+      std::lock_guard<mutex_type> guard(m_mutex);
+      if (m_count == 0) {
+         return false;
+      }
+      item = m_items[m_head];
+      m_head = (m_head + 1) & m_mask;
+      --m_count;
+      return true;
+   }
+};
+
+
+template<class T>
+class MpmcRing {
+   struct cell {
+      // pos: free for the push at pos; pos + 1: holds the item pushed at
+      // pos; then pos + capacity, free for the next lap.
+      std::atomic<size_t> sequence;
+      T item;
+   };
+
+   std::vector<cell> m_cells;
+   size_t m_mask;
+   alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_tail{0};
+   alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_head{0};
+
+public:
+   explicit MpmcRing(size_t capacity):
+      m_cells(ring_capacity(capacity)),
+      m_mask(m_cells.size() - 1)
+   {
+      for (size_t i = 0; i < m_cells.size(); ++i) {
+         m_cells[i].sequence.store(i, std::memory_order_relaxed);
+      }
+   }
+   MpmcRing(const MpmcRing& )= delete;
+   MpmcRing(MpmcRing&& )= delete;
+
+   bool try_push(const T& item) {
+      size_t pos = m_tail.load(std::memory_order_relaxed);
+      for (;;) {
+         cell& target = m_cells[pos & m_mask];
+         size_t sequence = target.sequence.load(std::memory_order_acquire);
+         auto lag = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+         if (lag == 0) {
+            if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+               target.item = item;
+               target.sequence.store(pos + 1, std::memory_order_release);
+               return true;
+            }
+         }
+         else if (lag < 0) {
+            // Not consumed since the previous lap: full.
+            return false;
+         }
+         else {
+            pos = m_tail.load(std::memory_order_relaxed);
+         }
+      }
+   }
+
+   bool try_pop(T& item) {
+      size_t pos = m_head.load(std::memory_order_relaxed);
+      for (;;) {
+         cell& source = m_cells[pos & m_mask];
+         size_t sequence = source.sequence.load(std::memory_order_acquire);
+         auto lag = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos + 1);
+         if (lag == 0) {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+               item = source.item;
+               source.sequence.store(pos + m_mask + 1, std::memory_order_release);
+               return true;
+            }
+         }
+         else if (lag < 0) {
+            // Not pushed yet: empty.
+            return false;
+         }
+         else {
+            pos = m_head.load(std::memory_order_relaxed);
+         }
+      }
+   }
+};
@@ -0,0 +1,150 @@
+/* NUMA-aware cohort lock (Dice, Marathe, Shavit: "Lock Cohorting").
+
+   Each NUMA node has its own local lock, and there's one global lock. A
+   thread takes its node's local lock first, and the global one only if its
+   cohort doesn't own it already. On release, if another thread of the same
+   node is waiting, the global lock is passed along with the local one, up to
+   maxPasses times in a row; otherwise (or then) the global lock is released
+   for the other nodes. This way, the lock words and the protected data mostly
+   bounce between cores of the same node.
+
+   Both levels are ticket locks: the global one must be releasable by a
+   different thread than the one acquiring it, and the local one must tell
+   whether someone else is waiting.
+
+   NodeMap decides which node the calling thread belongs to. On single-node
+   machines it splits the CPUs into virtual nodes, so the cohort logic is
+   exercised anywhere.
+*/
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "lock-utils.h"
+#include "placement.h"
+#include "queue-locks.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+
+class NodeMap {
+   std::vector<int> m_cpu_node;
+   int m_nodes{1};
+
+   NodeMap() { configure(read_cpu_topology(), 0); }
+
+public:
+   static NodeMap& instance() {
+      static NodeMap map;
+      return map;
+   }
+
+   // With virtualNodes == 0, uses the real NUMA nodes, falling back to two
+   // virtual nodes on single-node machines. A positive virtualNodes always
+   // splits the CPUs into that many virtual nodes, in topology order (so SMT
+   // siblings and cores of the same socket stay together).
+   // Not thread safe: call it before creating any CohortLock.
+   void configure(const std::vector<cpu_info>& topology, int virtualNodes) {
+      m_cpu_node.clear();
+      m_nodes = 1;
+      if (topology.empty()) {
+         return;
+      }
+
+      int maxCpu = 0;
+      std::vector<int> nodes;
+      for (const auto& info: topology) {
+         maxCpu = std::max(maxCpu, info.cpu);
+         if (std::find(nodes.begin(), nodes.end(), info.node) == nodes.end()) {
+            nodes.push_back(info.node);
+         }
+      }
+      m_cpu_node.assign(maxCpu + 1, 0);
+
+      if (virtualNodes == 0 && nodes.size() > 1) {
+         std::sort(nodes.begin(), nodes.end());
+         for (const auto& info: topology) {
+            m_cpu_node[info.cpu] = static_cast<int>(std::find(nodes.begin(), nodes.end(), info.node) - nodes.begin());
+         }
+         m_nodes = static_cast<int>(nodes.size());
+         return;
+      }
+
+      if (virtualNodes == 0) {
+         virtualNodes = 2;
+      }
+      m_nodes = std::max(1, std::min(virtualNodes, static_cast<int>(topology.size())));
+      for (size_t i = 0; i < topology.size(); ++i) {
+         m_cpu_node[topology[i].cpu] = static_cast<int>(i * m_nodes / topology.size());
+      }
+   }
+
+   int node_count() const noexcept { return m_nodes; }
+
+   int current_node() const noexcept {
+#if defined(__linux__)
+      int cpu = sched_getcpu();
+      if (cpu >= 0 && static_cast<size_t>(cpu) < m_cpu_node.size()) {
+         return m_cpu_node[cpu];
+      }
+#endif
+      return 0;
+   }
+};
+
+
+template<unsigned int maxPasses=64>
+class CohortLock {
+   struct alignas(CACHE_LINE_SIZE) node_lock {
+      TicketLock local;
+      // Only touched while holding the local lock.
+      bool global_owned{false};
+      unsigned int passes{0};
+   };
+
+   TicketLock m_global;
+   int m_nodes;
+   std::unique_ptr<node_lock[]> m_locals;
+   // Written and read only by the current owner.
+   alignas(CACHE_LINE_SIZE) int m_owner_node{0};
+
+public:
+   CohortLock():
+      m_nodes{NodeMap::instance().node_count()},
+      m_locals{new node_lock[m_nodes]}
+   {}
+   CohortLock(const CohortLock& )= delete;
+   CohortLock(CohortLock&& )= delete;
+   ~CohortLock() {}
+
+   void lock() noexcept {
+      // Migrating while waiting is harmless: whatever node we queue on, we
+      // stay there until unlock.
+      int node = NodeMap::instance().current_node();
+      node_lock& cohort = m_locals[node];
+      cohort.local.lock();
+      if (!cohort.global_owned) {
+         m_global.lock();
+         cohort.global_owned = true;
+         cohort.passes = 0;
+      }
+      m_owner_node = node;
+   }
+
+   void unlock() noexcept {
+      node_lock& cohort = m_locals[m_owner_node];
+      if (cohort.passes < maxPasses && cohort.local.has_waiters()) {
+         // Hand the global lock over to the next thread of our node.
+         ++cohort.passes;
+      }
+      else {
+         cohort.global_owned = false;
+         m_global.unlock();
+      }
+      cohort.local.unlock();
+   }
+};
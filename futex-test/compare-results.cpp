@@ -0,0 +1,348 @@
+/* Compares two result files of futex-test, i.e. a stored baseline and a
+   fresh run, to gate lock changes on performance.
+
+   Rows are matched by (Threads, Iterations, Non-contended Loops, Placement)
+   and the "Time X" columns of the locks present in both files are compared.
+   Files written before the Placement column existed count as "none". The
+   other run settings (critical section, oversubscription) don't have row
+   columns: a file with two rows of the same key is rejected rather than
+   letting one of them silently win. A lock
+   regresses when it got slower by more than --tolerance percent AND by more
+   than the noise: --noise-ms, or twice the combined standard deviation when
+   both files were produced with --repeat (and so have "Stddev X" columns).
+
+   Prints one semicolon separated row per compared lock and exits with 1 if
+   anything regressed, 2 on bad input, 0 otherwise.
+
+   Reads the files as main writes them, and as PowerShell redirects them on
+   Windows (UTF-16 with a byte order mark).
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+
+struct compare_options
+{
+	// Slowdown allowed before calling it a regression, in percent.
+	double tolerance{10.0};
+	// Differences up to this many milliseconds are noise, whatever the ratio.
+	double noise_ms{5.0};
+	std::string baseline;
+	std::string current;
+	bool help{false};
+};
+
+
+// Threads, Iterations, Non-contended Loops, Placement.
+using row_key = std::tuple<long long, long long, long long, std::string>;
+
+// Time and standard deviation (0 when unknown) of each lock, by name.
+struct lock_time
+{
+	double millis{0.0};
+	double stddev{0.0};
+};
+
+struct result_file
+{
+	// Lock names in column order.
+	std::vector<std::string> locks;
+	std::map<row_key, std::map<std::string, lock_time>> rows;
+};
+
+
+void print_usage(std::ostream& out, const char* program)
+{
+	out << "Usage: " << program << " [options] BASELINE.csv CURRENT.csv\n"
+		<< "\n"
+		<< "  --tolerance=PCT      slowdown allowed, in percent (default 10)\n"
+		<< "  --noise-ms=N         differences up to N ms are noise (default 5)\n"
+		<< "  --help               this text\n"
+		<< "\n"
+		<< "Exits with 1 if a lock got slower beyond both thresholds.\n";
+}
+
+
+double parse_number(const std::string& text, const char* what)
+{
+	size_t used = 0;
+	double value = 0.0;
+	try {
+		value = std::stod(text, &used);
+	}
+	catch (const std::exception&) {
+		used = 0;
+	}
+	if (used == 0 || used != text.size() || value < 0.0) {
+		throw std::invalid_argument(std::string("invalid ") + what + " \"" + text + "\"");
+	}
+	return value;
+}
+
+
+compare_options parse_command_line(int argc, char* argv[])
+{
+	compare_options options;
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto eq = arg.find('=');
+		std::string name = arg.substr(0, eq);
+		std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		if (arg.compare(0, 2, "--") != 0) {
+			files.push_back(arg);
+		}
+		else if (arg == "--help") {
+			options.help = true;
+		}
+		else if (name == "--tolerance") {
+			options.tolerance = parse_number(value, "tolerance");
+		}
+		else if (name == "--noise-ms") {
+			options.noise_ms = parse_number(value, "noise threshold");
+		}
+		else {
+			throw std::invalid_argument("unknown option \"" + arg + "\"");
+		}
+	}
+	if (!options.help && files.size() != 2) {
+		throw std::invalid_argument("expecting a baseline and a current result file");
+	}
+	if (files.size() == 2) {
+		options.baseline = files[0];
+		options.current = files[1];
+	}
+	return options;
+}
+
+
+// The file as plain text; UTF-16 files (written by PowerShell) only hold
+// ASCII, so dropping the high bytes is enough.
+std::string read_text(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("cannot read \"" + path + "\"");
+	}
+	std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	if (bytes.size() >= 2 && bytes[0] == '\xFF' && bytes[1] == '\xFE') {
+		std::string text;
+		for (size_t pos = 2; pos + 1 < bytes.size(); pos += 2) {
+			text += bytes[pos];
+		}
+		return text;
+	}
+	if (bytes.size() >= 2 && bytes[0] == '\xFE' && bytes[1] == '\xFF') {
+		std::string text;
+		for (size_t pos = 3; pos < bytes.size(); pos += 2) {
+			text += bytes[pos];
+		}
+		return text;
+	}
+	if (bytes.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+		return bytes.substr(3);
+	}
+	return bytes;
+}
+
+
+// Semicolon separated fields, without the surrounding blanks and quotes;
+// the empty field after the trailing semicolon is dropped.
+std::vector<std::string> split_fields(const std::string& line)
+{
+	std::vector<std::string> fields;
+	std::istringstream in(line);
+	std::string field;
+	while (std::getline(in, field, ';')) {
+		auto first = field.find_first_not_of(" \t\r\"");
+		auto last = field.find_last_not_of(" \t\r\"");
+		fields.push_back(first == std::string::npos ? "" : field.substr(first, last - first + 1));
+	}
+	while (!fields.empty() && fields.back().empty()) {
+		fields.pop_back();
+	}
+	return fields;
+}
+
+
+int find_column(const std::vector<std::string>& header, const std::string& name)
+{
+	auto it = std::find(header.begin(), header.end(), name);
+	return it == header.end() ? -1 : static_cast<int>(it - header.begin());
+}
+
+
+result_file load_results(const std::string& path)
+{
+	std::istringstream in(read_text(path));
+	std::string line;
+	std::vector<std::string> header;
+	while (header.empty() && std::getline(in, line)) {
+		header = split_fields(line);
+	}
+
+	// The dry run writes its time as "Baseline", followed by an unnamed
+	// relative column.
+	int baseline = find_column(header, "Baseline");
+	if (baseline >= 0) {
+		header[baseline] = "Time Baseline";
+		if (find_column(header, "Rel Baseline") < 0) {
+			header.insert(header.begin() + baseline + 1, "Rel Baseline");
+		}
+	}
+
+	int threads = find_column(header, "Threads");
+	int iterations = find_column(header, "Iterations");
+	int loops = find_column(header, "Non-contended Loops");
+	if (threads < 0 || iterations < 0 || loops < 0) {
+		throw std::runtime_error("\"" + path + "\" is not a futex-test result file");
+	}
+	int placement = find_column(header, "Placement");
+
+	result_file results;
+	std::vector<std::pair<int, int>> columns;
+	for (size_t i = 0; i < header.size(); ++i) {
+		if (header[i].compare(0, 5, "Time ") == 0) {
+			std::string lock = header[i].substr(5);
+			results.locks.push_back(lock);
+			columns.emplace_back(static_cast<int>(i), find_column(header, "Stddev " + lock));
+		}
+	}
+
+	int lineNumber = 1;
+	while (std::getline(in, line)) {
+		++lineNumber;
+		auto fields = split_fields(line);
+		if (fields.empty()) {
+			continue;
+		}
+		if (fields.size() < header.size()) {
+			throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": missing fields");
+		}
+		try {
+			row_key key(std::stoll(fields[threads]), std::stoll(fields[iterations]), std::stoll(fields[loops]),
+					placement >= 0 ? fields[placement] : "none");
+			if (results.rows.count(key)) {
+				throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": duplicate row");
+			}
+			auto& row = results.rows[key];
+			for (size_t i = 0; i < columns.size(); ++i) {
+				lock_time& time = row[results.locks[i]];
+				time.millis = std::stod(fields[columns[i].first]);
+				if (columns[i].second >= 0) {
+					time.stddev = std::stod(fields[columns[i].second]);
+				}
+			}
+		}
+		catch (const std::logic_error&) {
+			throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": not a number");
+		}
+	}
+	return results;
+}
+
+
+int main(int argc, char* argv[])
+{
+	compare_options options;
+	result_file baseline;
+	result_file current;
+	try {
+		options = parse_command_line(argc, argv);
+		if (options.help) {
+			print_usage(std::cout, argv[0]);
+			return 0;
+		}
+		baseline = load_results(options.baseline);
+		current = load_results(options.current);
+	}
+	catch (const std::invalid_argument& e) {
+		std::cerr << argv[0] << ": " << e.what() << "\n";
+		print_usage(std::cerr, argv[0]);
+		return 2;
+	}
+	catch (const std::exception& e) {
+		std::cerr << argv[0] << ": " << e.what() << "\n";
+		return 2;
+	}
+
+	std::vector<std::string> locks;
+	for (const auto& lock: current.locks) {
+		if (std::find(baseline.locks.begin(), baseline.locks.end(), lock) != baseline.locks.end()) {
+			locks.push_back(lock);
+		}
+	}
+	if (locks.empty()) {
+		std::cerr << argv[0] << ": no lock in common\n";
+		return 2;
+	}
+
+	std::cout << "\"Threads\"; \"Iterations\"; \"Non-contended Loops\"; \"Placement\"; \"Lock\"; "
+			  << "\"Baseline ms\"; \"Current ms\"; \"Speedup\"; \"Noise ms\"; \"Verdict\";\n";
+	int compared = 0;
+	int regressions = 0;
+	int improvements = 0;
+	int unmatched = 0;
+	for (const auto& entry: current.rows) {
+		auto match = baseline.rows.find(entry.first);
+		if (match == baseline.rows.end()) {
+			++unmatched;
+			continue;
+		}
+
+		for (const auto& lock: locks) {
+			const lock_time& before = match->second.at(lock);
+			const lock_time& after = entry.second.at(lock);
+			double noise = std::max(options.noise_ms,
+					2.0 * std::sqrt(before.stddev * before.stddev + after.stddev * after.stddev));
+			double delta = after.millis - before.millis;
+			double allowed = before.millis * options.tolerance / 100.0;
+
+			const char* verdict = "same";
+			if (delta > noise && delta > allowed) {
+				verdict = "REGRESSION";
+				++regressions;
+			}
+			else if (-delta > noise && -delta > allowed) {
+				verdict = "faster";
+				++improvements;
+			}
+			++compared;
+
+			std::cout << std::get<0>(entry.first) << "; "
+					  << std::get<1>(entry.first) << "; "
+					  << std::get<2>(entry.first) << "; "
+					  << std::get<3>(entry.first) << "; "
+					  << "\"" << lock << "\"; "
+					  << before.millis << "; "
+					  << after.millis << "; ";
+			if (after.millis > 0.0) {
+				std::cout << before.millis / after.millis << "; ";
+			}
+			else {
+				std::cout << "; ";
+			}
+			std::cout << noise << "; " << verdict << ";\n";
+		}
+	}
+
+	std::cerr << compared << " timings compared: " << regressions << " regressions, "
+			  << improvements << " improvements";
+	if (unmatched) {
+		std::cerr << ", " << unmatched << " rows missing from the baseline";
+	}
+	std::cerr << "\n";
+	return regressions ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+/* Delegation: instead of moving the lock (and the protected data) from core
+   to core, threads hand their critical section over to whoever holds the
+   data, and wait for it to be done.
+
+   - FlatCombiner: each thread publishes its operation in its own slot; the
+     first one to grab the combiner lock runs every pending operation in a
+     batch, so the data stays in its cache while the others just wait for
+     their slot to be cleared.
+   - DelegationServer: ffwd-style, a dedicated server thread polls the slots
+     and runs the operations; clients never touch the data at all. Unlike
+     the real ffwd, responses aren't batched in shared lines: each client
+     is answered by clearing the flag in its own slot.
+
+   Both run operations strictly one at a time, so they give the same
+   guarantees as a lock around the operation. Clients are identified by a
+   slot number in [0, slotCount), given by the caller, and must not share it.
+   Note that the work done by the server thread doesn't show in the clients'
+   perf counters.
+*/
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "lock-utils.h"
+
+
+// A published operation; pending is cleared once it has run.
+struct alignas(CACHE_LINE_SIZE) DelegationSlot {
+   std::atomic<bool> pending{false};
+   void (*run)(void*){nullptr};
+   void* op{nullptr};
+
+   template<class Op>
+   void publish(Op& operation) noexcept {
+      op = &operation;
+      run = [](void* o) { (*static_cast<Op*>(o))(); };
+      pending.store(true, std::memory_order_release);
+   }
+
+   // Runs the operation if one is waiting; returns whether it did.
+   bool serve() {
+      if (!pending.load(std::memory_order_acquire)) {
+         return false;
+      }
+      run(op);
+      pending.store(false, std::memory_order_release);
+      return true;
+   }
+
+   bool done() const noexcept {
+      return !pending.load(std::memory_order_acquire);
+   }
+};
+
+
+class FlatCombiner {
+   // Scans per combining round; stops earlier when a scan finds nothing.
+   enum {MAX_PASSES=4};
+
+   alignas(CACHE_LINE_SIZE) std::atomic<bool> m_combining{false};
+   std::vector<DelegationSlot> m_slots;
+
+public:
+   explicit FlatCombiner(int slotCount): m_slots(slotCount) {}
+   FlatCombiner(const FlatCombiner& )= delete;
+   FlatCombiner(FlatCombiner&& )= delete;
+   ~FlatCombiner() {}
+
+   template<class Op>
+   void execute(int slot, Op& operation) {
+      DelegationSlot& mine = m_slots[slot];
+      mine.publish(operation);
+      SpinWait spin;
+      while (!mine.done()) {
+         if (!m_combining.load(std::memory_order_relaxed)
+               && !m_combining.exchange(true, std::memory_order_acquire)) {
+            // Our own operation is pending, so the first pass serves it.
+            combine();
+            m_combining.store(false, std::memory_order_release);
+            return;
+         }
+         spin();
+      }
+   }
+
+private:
+   void combine() {
+      for (int pass = 0; pass < MAX_PASSES; ++pass) {
+         bool served = false;
+         for (auto& slot: m_slots) {
+            served = slot.serve() || served;
+         }
+         if (!served) {
+            break;
+         }
+      }
+   }
+};
+
+
+class DelegationServer {
+   alignas(CACHE_LINE_SIZE) std::atomic<bool> m_stop{false};
+   std::vector<DelegationSlot> m_slots;
+   // Last, so that it starts when the slots are ready.
+   std::thread m_server;
+
+public:
+   explicit DelegationServer(int slotCount):
+      m_slots(slotCount),
+      m_server([this]() { serve(); })
+   {}
+   DelegationServer(const DelegationServer& )= delete;
+   DelegationServer(DelegationServer&& )= delete;
+
+   ~DelegationServer() {
+      m_stop.store(true, std::memory_order_release);
+      m_server.join();
+   }
+
+   template<class Op>
+   void execute(int slot, Op& operation) {
+      DelegationSlot& mine = m_slots[slot];
+      mine.publish(operation);
+      SpinWait spin;
+      while (!mine.done()) {
+         spin();
+      }
+   }
+
+private:
+   void serve() {
+      SpinWait spin;
+      while (!m_stop.load(std::memory_order_acquire)) {
+         bool served = false;
+         for (auto& slot: m_slots) {
+            served = slot.serve() || served;
+         }
+         if (!served) {
+            spin();
+         }
+      }
+   }
+};
@@ -0,0 +1,43 @@
+/* Fairness bookkeeping for the lock benchmark.
+
+   A lock can win on throughput by letting the same thread reacquire it over
+   and over while the others starve; these help spotting that.
+*/
+#pragma once
+
+#include <vector>
+
+// Who got the lock last, and how many times in a row. Shared by all the
+// threads, but only touched while holding the lock under test, so it needs
+// no synchronization of its own.
+struct acquisition_order
+{
+	int last_owner{-1};
+	long long streak{0};
+
+	// Returns the length of the streak the new owner is on.
+	long long acquired_by(int owner) noexcept {
+		if (owner == last_owner) {
+			return ++streak;
+		}
+		last_owner = owner;
+		return streak = 1;
+	}
+};
+
+
+// Jain's fairness index: 1 when all the values are equal, down to 1/n when
+// a single one gets everything.
+inline double jain_index(const std::vector<double>& values)
+{
+	double sum = 0.0;
+	double sum_sq = 0.0;
+	for (double value: values) {
+		sum += value;
+		sum_sq += value * value;
+	}
+	if (sum_sq == 0.0) {
+		return 1.0;
+	}
+	return sum * sum / (static_cast<double>(values.size()) * sum_sq);
+}
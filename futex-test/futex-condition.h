@@ -0,0 +1,94 @@
+/* Condition variable for the futex locks.
+
+   Waiters park on a sequence counter that every notification bumps: a
+   waiter reads it while still holding the lock, so a notification sent
+   after the waiter released the lock changes the word, and the futex wait
+   returns at once instead of missing it. A waiter count lets the notifying
+   side skip the syscall when nobody is parked.
+
+   Like std::condition_variable_any, it works with any lock that has
+   lock()/unlock() (std::unique_lock of whatever mutex, or the mutex
+   itself), and waits may return spuriously. Waits can also miss a wakeup
+   if exactly 2^32 notifications happen between reading the counter and
+   parking, which we can live with.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+
+#include "sys-futex.h"
+
+class FutexCondition {
+   std::atomic<int> m_sequence{0};
+   std::atomic<int> m_waiters{0};
+
+public:
+   FutexCondition() {}
+   FutexCondition(const FutexCondition& )= delete;
+   FutexCondition(FutexCondition&& )= delete;
+   ~FutexCondition() {}
+
+   template<class Lock>
+   void wait(Lock& lock) {
+      int sequence = enter();
+      lock.unlock();
+      futex_wait(m_sequence, sequence);
+      m_waiters.fetch_sub(1, std::memory_order_relaxed);
+      lock.lock();
+   }
+
+   template<class Lock, class Predicate>
+   void wait(Lock& lock, Predicate ready) {
+      while (!ready()) {
+         wait(lock);
+      }
+   }
+
+   template<class Lock, class Clock, class Duration>
+   std::cv_status wait_until(Lock& lock, const std::chrono::time_point<Clock, Duration>& deadline) {
+      auto remaining = deadline - Clock::now();
+      if (remaining <= decltype(remaining)::zero()) {
+         return std::cv_status::timeout;
+      }
+      int sequence = enter();
+      lock.unlock();
+      futex_wait_for(m_sequence, sequence, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+      m_waiters.fetch_sub(1, std::memory_order_relaxed);
+      lock.lock();
+      return Clock::now() >= deadline ? std::cv_status::timeout : std::cv_status::no_timeout;
+   }
+
+   template<class Lock, class Rep, class Period>
+   std::cv_status wait_for(Lock& lock, const std::chrono::duration<Rep, Period>& timeout) {
+      return wait_until(lock, std::chrono::steady_clock::now() + timeout);
+   }
+
+   void notify_one() noexcept {
+      notify(1);
+   }
+
+   void notify_all() noexcept {
+      notify(INT_MAX);
+   }
+
+private:
+   // Called with the lock held; returns the sequence to park on.
+   int enter() noexcept {
+      // The predicate only changes under the lock, which we hold: the
+      // notification of a change we haven't seen comes after our unlock,
+      // so the lock alone makes sure it finds us in the count, and bumps
+      // the sequence after we read it.
+      m_waiters.fetch_add(1, std::memory_order_relaxed);
+      return m_sequence.load(std::memory_order_relaxed);
+   }
+
+   void notify(int count) noexcept {
+      m_sequence.fetch_add(1, std::memory_order_relaxed);
+      if (m_waiters.load(std::memory_order_relaxed) != 0) {
+         futex_wake(m_sequence, count);
+      }
+   }
+};
@@ -1,13 +1,38 @@
 /* Test for futex */
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
 #include <vector>
 #include <iostream>
+#include <memory>
+#include <new>
 #include <sstream>
+#include <string>
+#include <type_traits>
 
+#include "adaptive-futex.h"
+#include "async-mutex.h"
+#include "backoff.h"
+#include "bounded-queue.h"
+#include "cohort-lock.h"
+#include "delegation.h"
+#include "fairness.h"
+#include "futex-condition.h"
+#include "latency-histogram.h"
+#include "parking-futex.h"
+#include "options.h"
+#include "perf-counters.h"
+#include "placement.h"
+#include "queue-locks.h"
+#include "rw-locks.h"
 
 #ifdef _MSC_VER
 #define NOOP __asm nop
@@ -21,68 +46,298 @@ enum {
 };
 
 
-template<unsigned int spinCount=0>
-class Futex {
-   std::atomic<bool> m_owned{false};
+// Test-and-set lock; what to do between failed attempts is up to the
+// Backoff policy (see backoff.h).
+template<class Backoff>
+class BasicFutex {
+   std::atomic<int> m_owned{0};
+   typename Backoff::lock_state m_backoff;
 
 public:
-   Futex() {}
-   Futex(const Futex& )= delete;
-   Futex(Futex&& )= delete;
-   ~Futex() {}
+   BasicFutex() {}
+   BasicFutex(const BasicFutex& )= delete;
+   BasicFutex(BasicFutex&& )= delete;
+   ~BasicFutex() {}
 
    void lock() noexcept {
-      if (spinCount == DRY_RUN) {
+      int isOwned = 0;
+      if (m_owned.compare_exchange_weak(isOwned, 1,
+            std::memory_order_acquire,
+            std::memory_order_relaxed)) {
          return;
       }
 
-      bool isOwned = false;
-      unsigned int sc = spinCount;
-      while(!m_owned.compare_exchange_weak(
-            isOwned, true,
-            std::memory_order_release,
-            std::memory_order_relaxed) || isOwned ) {
-         isOwned = false;
-
-		 // This will be optimized into a Yield, noop or a proper
-		 if (spinCount == 1) {
-			 std::this_thread::yield();
-		 }
-         else if(spinCount && --sc == 0) {
-            std::this_thread::yield();
+      Backoff backoff;
+      do {
+         backoff.wait(m_owned, m_backoff);
+         isOwned = 0;
+      } while(!m_owned.compare_exchange_weak(
+            isOwned, 1,
+            std::memory_order_acquire,
+            std::memory_order_relaxed));
+   }
+
+   bool try_lock() noexcept {
+      // Plain load first, so that failed tries don't steal the line.
+      int isOwned = 0;
+      return m_owned.load(std::memory_order_relaxed) == 0
+            && m_owned.compare_exchange_strong(isOwned, 1,
+                  std::memory_order_acquire,
+                  std::memory_order_relaxed);
+   }
+
+   // Waits like lock(), but not past the deadline: the parking policies
+   // sleep with a timeout (FUTEX_WAIT with a timespec), the others spin or
+   // yield between looks at the clock.
+   template<class Clock, class Duration>
+   bool try_lock_until(const std::chrono::time_point<Clock, Duration>& deadline) noexcept {
+      Backoff backoff;
+      while (!try_lock()) {
+         auto remaining = deadline - Clock::now();
+         if (remaining <= decltype(remaining)::zero()) {
+            return false;
+         }
+         if constexpr (requires { backoff.wait_for(m_owned, m_backoff, std::chrono::nanoseconds()); }) {
+            backoff.wait_for(m_owned, m_backoff, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+         }
+         else {
+            backoff.wait(m_owned, m_backoff);
          }
       }
+      return true;
+   }
+
+   template<class Rep, class Period>
+   bool try_lock_for(const std::chrono::duration<Rep, Period>& timeout) noexcept {
+      return try_lock_until(std::chrono::steady_clock::now() + timeout);
    }
 
    void unlock() noexcept {
-      if (spinCount == DRY_RUN) {
-         return;
-      }
-      m_owned.store(false, std::memory_order_release);
+      m_owned.store(0, std::memory_order_release);
+      Backoff::on_unlock(m_owned, m_backoff);
+   }
+};
+
+
+// Doesn't lock at all: measures the cost of the harness alone.
+class DryRunLock {
+public:
+   void lock() noexcept {}
+   void unlock() noexcept {}
+};
+
+
+template<unsigned int spinCount=0>
+using Futex = std::conditional_t<spinCount == DRY_RUN,
+      DryRunLock,
+      BasicFutex<SpinYieldBackoff<spinCount>>>;
+
+// Optional per-thread instrumentation of check_func.
+struct alignas(CACHE_LINE_SIZE) thread_probe
+{
+	int id{0};
+	// Where to record the lock() wait times, if wanted.
+	LatencyHistogram* waits{nullptr};
+	// Acquisition order shared by all threads, if tracking fairness.
+	acquisition_order* order{nullptr};
+	long long longest_streak{0};
+	// Operations this thread did: perfCount unless the body says otherwise
+	// (consumers do their share of the items).
+	long long operations{0};
+	// When this thread went past the start barrier, and when it was done.
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point finish;
+};
+
+
+// The ints a critical section touches (see the --cs-* options), as offsets
+// from the start of the guarded data.
+struct critical_section
+{
+	std::vector<size_t> writes;
+	std::vector<size_t> reads;
+	// Ints from the first touched one to the last, included.
+	size_t extent{0};
+
+	explicit critical_section(const harness_options& options)
+	{
+		size_t count = options.cs_bytes / sizeof(int);
+		size_t stride = options.cs_stride / sizeof(int);
+		for (size_t k = 0; k < count; ++k) {
+			// Spreads the writes evenly among the touched ints.
+			bool write = (k + 1) * options.cs_write_percent / 100 != k * options.cs_write_percent / 100;
+			(write ? writes : reads).push_back(k * stride);
+		}
+		extent = (count - 1) * stride + 1;
+	}
+
+	// Increments the written ints; returns the sum of the ones only read,
+	// so that reading them can't be optimized away.
+	int run(int* data) const
+	{
+		for (size_t offset: writes) {
+			data[offset]++;
+		}
+		int seen = 0;
+		for (size_t offset: reads) {
+			seen += data[offset];
+		}
+		return seen;
+	}
+};
+
+
+// The lock and the data it guards, in one cache-aligned block: padded puts
+// the data on the line after the lock, shared right after the lock word
+// (locks that pad themselves stay padded anyway).
+template<class mutex_type>
+class guarded_data {
+   static constexpr size_t ALIGNMENT = alignof(mutex_type) > CACHE_LINE_SIZE ? alignof(mutex_type) : CACHE_LINE_SIZE;
+
+   void* m_block;
+   size_t m_extent;
+   mutex_type* m_mutex;
+   int* m_data;
+
+public:
+   guarded_data(const critical_section& cs, bool sharedLine):
+      m_extent(cs.extent)
+   {
+      size_t padding = sharedLine ? alignof(int) : ALIGNMENT;
+      size_t offset = (sizeof(mutex_type) + padding - 1) / padding * padding;
+      m_block = ::operator new(offset + m_extent * sizeof(int), std::align_val_t(ALIGNMENT));
+      m_mutex = new (m_block) mutex_type;
+      m_data = new (static_cast<char*>(m_block) + offset) int[m_extent]();
+   }
+   guarded_data(const guarded_data& )= delete;
+   guarded_data(guarded_data&& )= delete;
+
+   ~guarded_data() {
+      m_mutex->~mutex_type();
+      ::operator delete(m_block, std::align_val_t(ALIGNMENT));
+   }
+
+   mutex_type& mutex() noexcept { return *m_mutex; }
+   int* data() noexcept { return m_data; }
+};
+
+
+// One copy of the critical section data per thread, each starting on its
+// own cache line and padded to whole lines, so that no two threads ever
+// touch the same line whatever the footprint.
+class sharded_data {
+   static constexpr size_t LINE_INTS = CACHE_LINE_SIZE / sizeof(int);
+
+   int* m_block;
+   size_t m_stride;
+   int m_shards;
+
+public:
+   sharded_data(const critical_section& cs, int shards):
+      m_stride((cs.extent + LINE_INTS - 1) / LINE_INTS * LINE_INTS),
+      m_shards(shards)
+   {
+      void* block = ::operator new(m_shards * m_stride * sizeof(int), std::align_val_t(CACHE_LINE_SIZE));
+      m_block = new (block) int[m_shards * m_stride]();
    }
-   
-   unsigned int get_spin() const { return spinCount; }
+   sharded_data(const sharded_data& )= delete;
+   sharded_data(sharded_data&& )= delete;
+
+   ~sharded_data() {
+      ::operator delete(m_block, std::align_val_t(CACHE_LINE_SIZE));
+   }
+
+   int shards() const noexcept { return m_shards; }
+   int* shard(int i) noexcept { return m_block + i * m_stride; }
+   const int* shard(int i) const noexcept { return m_block + i * m_stride; }
 };
 
+
 template<class mutex_type>
-void check_func(std::vector<int>& shared_data, mutex_type& mutex, int perfCount, int outOfBusyLoopCount) {
+void check_func(const critical_section& cs, int* data, mutex_type& mutex, int perfCount, int outOfBusyLoopCount,
+		thread_probe& probe) {
 	volatile int dummy = 1;
+	int seen = 0;
 
 	for (int i = 0; i < perfCount; ++i) {
 		// Simulate some out of the main loop operation
 		for (int j = 0; j < outOfBusyLoopCount; ++j) {
-			++dummy;
+			dummy = dummy + 1;
 			NOOP
 		}
 		
-		std::lock_guard<mutex_type> guard(mutex);
-    	for(int pos = 0; pos < shared_data.size(); pos += shared_data.size()/CHANGE_COUNT) {
-            shared_data[pos]++;
-        }
+		if (probe.waits) {
+			auto before = std::chrono::steady_clock::now();
+			mutex.lock();
+			auto after = std::chrono::steady_clock::now();
+			probe.waits->record(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+		}
+		else {
+			mutex.lock();
+		}
+		std::lock_guard<mutex_type> guard(mutex, std::adopt_lock);
+		if (probe.order) {
+			long long streak = probe.order->acquired_by(probe.id);
+			if (streak > probe.longest_streak) {
+				probe.longest_streak = streak;
+			}
+		}
+		seen += cs.run(data);
 	}
+	dummy = seen;
 };
 
 
+// Same workload as check_func, but the critical section is handed over to
+// a FlatCombiner or DelegationServer (see delegation.h) instead of being run
+// under a lock. Wait times cover the whole delegated operation.
+template<class executor_type>
+void delegate_func(const critical_section& cs, int* data, executor_type& executor, int perfCount, int outOfBusyLoopCount,
+		thread_probe& probe) {
+	volatile int dummy = 1;
+	int seen = 0;
+
+	auto operation = [&]() {
+		if (probe.order) {
+			long long streak = probe.order->acquired_by(probe.id);
+			if (streak > probe.longest_streak) {
+				probe.longest_streak = streak;
+			}
+		}
+		seen += cs.run(data);
+	};
+
+	for (int i = 0; i < perfCount; ++i) {
+		for (int j = 0; j < outOfBusyLoopCount; ++j) {
+			dummy = dummy + 1;
+			NOOP
+		}
+
+		if (probe.waits) {
+			auto before = std::chrono::steady_clock::now();
+			executor.execute(probe.id, operation);
+			auto after = std::chrono::steady_clock::now();
+			probe.waits->record(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+		}
+		else {
+			executor.execute(probe.id, operation);
+		}
+	}
+	dummy = seen;
+}
+
+
+// Sum of the ints the critical section writes.
+long long checkSharedData(const critical_section& cs, const int* data)
+{
+    long long count = 0;
+    for (size_t offset: cs.writes) {
+        count += data[offset];
+    }
+    return count;
+}
+
+
 long long checkSharedData(std::vector<int>& shared_data)
 {
     long long count = 0;
@@ -93,143 +348,1497 @@ long long checkSharedData(std::vector<int>& shared_data)
 }
 
 
-template<class mutex_type>
-auto performance_test(bool dry, mutex_type& mutex, int threadCount, int perfCount, int outOfBusyLoopCount)
+// Lock-free layouts of the same critical section, for the unlocked upper bounds.
+long long checkSharedData(const critical_section& cs, const std::vector<std::atomic<int>>& shared_data)
+{
+    long long count = 0;
+    for (size_t offset: cs.writes) {
+        count += shared_data[offset].load(std::memory_order_relaxed);
+    }
+    return count;
+}
+
+
+// Merges the shards: the counters are the sum of all the copies.
+long long checkSharedData(const critical_section& cs, const sharded_data& shards)
+{
+    long long count = 0;
+    for (int i = 0; i < shards.shards(); ++i) {
+        count += checkSharedData(cs, shards.shard(i));
+    }
+    return count;
+}
+
+
+struct test_result
+{
+	// From the start barrier to the last thread done.
+	long long millis;
+	double seconds{0.0};
+	// Lock acquisitions per second, all threads together and per thread.
+	double throughput{0.0};
+	double thread_throughput{0.0};
+	double min_thread_throughput{0.0};
+
+	// Merged per-thread lock() wait times, only filled when measuring latency.
+	LatencyHistogram waits;
+
+	// Only filled when tracking fairness.
+	std::vector<double> finish_ms;
+	long long longest_streak{0};
+	double jain{1.0};
+
+	// Sum of the per-thread counters, only filled when counting.
+	perf_sample perf;
+
+	// Read-mostly workload: reads per second (the writers' lock waits go in
+	// the waits histogram). Producer/consumer: items per second (and the
+	// consumers' wakeup latencies in the waits histogram).
+	double workload_throughput{0.0};
+};
+
+
+// Runs body(i, probe) on threadCount workers, all started together, and
+// collects the timings and instrumentation. Each worker is expected to do
+// perfCount lock acquisitions, unless it sets its probe's operations.
+template<class Body>
+test_result run_workers(const harness_options& options, int threadCount, int perfCount, Body body)
 {
-	auto now = std::chrono::high_resolution_clock::now();
+	test_result result;
+	std::vector<LatencyHistogram> waits(options.latency ? threadCount : 0);
+	std::vector<thread_probe> probes(threadCount);
+	std::vector<perf_sample> counters(threadCount);
+	acquisition_order order;
+	for (int i = 0; i < threadCount; ++i) {
+		probes[i].id = i;
+		probes[i].operations = perfCount;
+		probes[i].waits = options.latency ? &waits[i] : nullptr;
+		probes[i].order = options.fairness ? &order : nullptr;
+	}
+
+	// Workers get ready (pinned, counters open) and then spin here, so that
+	// thread creation stays out of the measure and nobody runs uncontended
+	// while the others are still being spawned.
+	std::atomic<int> ready{0};
+	std::atomic<bool> go{false};
+	std::atomic<int> unpinned{0};
+
+	// CPU hogs compete with the workers for the whole measure, so that lock
+	// holders get preempted.
+	std::atomic<bool> stop_hogs{false};
+	std::vector<std::thread> hogs;
+	for (int i = 0; i < options.hogs; ++i) {
+		hogs.emplace_back([&]() {
+			volatile long long burnt = 0;
+			while (!stop_hogs.load(std::memory_order_relaxed)) {
+				burnt = burnt + 1;
+			}
+		});
+	}
 
-    std::vector<int> shared_data(0x100000);
-	
    // Thread launcher
    std::vector<std::thread> threads;
    for (int i = 0; i < threadCount; ++i) {
 	   threads.emplace_back(
-		   [&]() {
-			check_func(shared_data, mutex, perfCount, outOfBusyLoopCount);
+		   [&, i]() {
+			if (!options.cpu_order.empty()
+					&& !pin_current_thread(options.cpu_order[i % options.cpu_order.size()])) {
+				unpinned.fetch_add(1, std::memory_order_relaxed);
+			}
+			std::unique_ptr<PerfCounters> perf;
+			if (options.perf) {
+				perf = std::make_unique<PerfCounters>();
+			}
+
+			ready.fetch_add(1, std::memory_order_release);
+			SpinWait spin;
+			while (!go.load(std::memory_order_acquire)) {
+				spin();
+			}
+
+			if (perf) {
+				perf->start();
+			}
+			probes[i].start = std::chrono::steady_clock::now();
+			body(i, probes[i]);
+			probes[i].finish = std::chrono::steady_clock::now();
+			if (perf) {
+				perf->stop();
+				counters[i] = perf->read();
+			}
 		   }
 	   );
    }
 
+   while (ready.load(std::memory_order_acquire) < threadCount) {
+      std::this_thread::yield();
+   }
+   auto start = std::chrono::steady_clock::now();
+   go.store(true, std::memory_order_release);
+
    // Waiting for threads to be done
    for (auto& thread: threads) {
       thread.join();
    }
+   stop_hogs.store(true, std::memory_order_relaxed);
+   for (auto& hog: hogs) {
+      hog.join();
+   }
+   if (unpinned.load(std::memory_order_relaxed)) {
+      std::cerr << unpinned.load(std::memory_order_relaxed) << " of " << threadCount
+                << " threads couldn't be pinned\n";
+   }
 
-   auto after = std::chrono::high_resolution_clock::now();
-   
-   // this will ensure memory coherency
-   long long fullCount = checkSharedData(shared_data);
+   auto after = start;
+   long long operations = 0;
+   double thread_throughputs = 0.0;
+   result.min_thread_throughput = -1.0;
+   for (const auto& probe: probes) {
+      after = std::max(after, probe.finish);
+      operations += probe.operations;
+      double seconds = std::chrono::duration<double>(probe.finish - probe.start).count();
+      double throughput = seconds > 0.0 ? probe.operations / seconds : 0.0;
+      thread_throughputs += throughput;
+      if (result.min_thread_throughput < 0.0 || throughput < result.min_thread_throughput) {
+         result.min_thread_throughput = throughput;
+      }
+   }
+   double seconds = std::chrono::duration<double>(after - start).count();
+   result.throughput = seconds > 0.0 ? static_cast<double>(operations) / seconds : 0.0;
+   result.thread_throughput = thread_throughputs / threadCount;
+   result.seconds = seconds;
+
+   for (const auto& thread_waits: waits) {
+      result.waits.merge(thread_waits);
+   }
+
+   if (options.perf) {
+      result.perf = counters[0];
+      for (int i = 1; i < threadCount; ++i) {
+         result.perf.merge(counters[i]);
+      }
+   }
+
+   if (options.fairness) {
+      // Every thread does about the same work, so a fair lock finishes them together.
+      std::vector<double> throughputs;
+      for (const auto& probe: probes) {
+         double ms = std::chrono::duration<double, std::milli>(probe.finish - start).count();
+         result.finish_ms.push_back(ms);
+         throughputs.push_back(ms > 0.0 ? probe.operations / ms : 0.0);
+         result.longest_streak = std::max(result.longest_streak, probe.longest_streak);
+      }
+      result.jain = jain_index(throughputs);
+   }
+   result.millis = std::chrono::duration_cast<std::chrono::milliseconds>(after - start).count();
+   return result;
+}
+
+
+// Throws if the threads didn't do all their increments, given the sum of
+// the counters: each iteration of each thread adds 1 to writeCount of them.
+void checkParagon(const harness_options& options, long long fullCount, int threadCount, int perfCount,
+		size_t writeCount = CHANGE_COUNT)
+{
    long long paragon = static_cast<long long>(perfCount) * 
-                        static_cast<long long>(threadCount) * CHANGE_COUNT;
+                        static_cast<long long>(threadCount) * writeCount;
                         
-   if (!dry && fullCount != paragon)
+   if (!options.dry_run && fullCount != paragon)
    {
        std::ostringstream ss;
        ss << "Lock failed: " << fullCount << "/" << paragon;
        throw std::runtime_error(ss.str().c_str());
    }
-   return std::chrono::duration_cast<std::chrono::milliseconds>(after - now).count();
 }
 
 
-auto all_timings(bool dry_run, int threadCount, int perfCount, int outOfBusyLoopCount)
+template<class mutex_type>
+test_result performance_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
 {
-	Futex<DRY_RUN> dry;
-	Futex<0> futex;
-	Futex<1> yield_futex;
-	Futex<0x40> sl_futex;
-	std::mutex mutex;
+    critical_section cs(options);
+    guarded_data<mutex_type> shared(cs, options.lock_shares_line);
 
-	std::vector<long long> timings;
-	if (dry_run) {
-           timings = {performance_test(true, dry, threadCount, perfCount, outOfBusyLoopCount),};
-	}
-        else {
-	   timings = {
-          performance_test(false, futex, threadCount, perfCount, outOfBusyLoopCount),
-          performance_test(false, yield_futex, threadCount, perfCount, outOfBusyLoopCount),
-          performance_test(false, sl_futex, threadCount, perfCount, outOfBusyLoopCount),
-	      performance_test(false, mutex, threadCount, perfCount, outOfBusyLoopCount)
-	   };
-        }
+	test_result result = run_workers(options, threadCount, perfCount,
+		[&](int, thread_probe& probe) {
+			check_func(cs, shared.data(), shared.mutex(), perfCount, outOfBusyLoopCount, probe);
+		});
 
-	return timings;
+   // this will ensure memory coherency
+   checkParagon(options, checkSharedData(cs, shared.data()), threadCount, perfCount, cs.writes.size());
+   return result;
 }
 
 
-void line_test(bool dry_run, int threadCount, int perfCount, int outOfBusyLoopCount)
+// Relaxed atomic accesses to plain counters: for the SeqLock readers, which
+// race with the writers by design, and to keep the compiler from merging
+// the updates of a thread that needs no synchronization.
+inline int load_slot(const int& slot)
 {
-	std::cout << threadCount << "; "
-			  << perfCount << "; "
-			  << outOfBusyLoopCount << "; " << std::flush;
+#if defined(__GNUC__)
+	return __atomic_load_n(&slot, __ATOMIC_RELAXED);
+#else
+	return *static_cast<const volatile int*>(&slot);
+#endif
+}
 
-	auto timings = all_timings(dry_run, threadCount, perfCount, outOfBusyLoopCount);
+inline void store_slot(int& slot, int value)
+{
+#if defined(__GNUC__)
+	__atomic_store_n(&slot, value, __ATOMIC_RELAXED);
+#else
+	*static_cast<volatile int*>(&slot) = value;
+#endif
+}
 
-	double min_time = 9999999999.0;
-	for(const auto& timing: timings) {
-		if (static_cast<double>(timing) < min_time && timing > 0.0) {
-			min_time = static_cast<double>(timing);
+
+// Same workload as check_func with no lock at all: update() does the
+// critical section's accesses itself, safely, and returns the sum of the
+// ints it only read. Neither lock waits nor acquisition order mean anything
+// here, so the probe is left alone.
+template<class Update>
+void unlocked_func(int perfCount, int outOfBusyLoopCount, Update update) {
+	volatile int dummy = 1;
+	int seen = 0;
+
+	for (int i = 0; i < perfCount; ++i) {
+		for (int j = 0; j < outOfBusyLoopCount; ++j) {
+			dummy = dummy + 1;
+			NOOP
 		}
-		std::cout << timing << "; ";
+		seen += update();
 	}
+	dummy = seen;
+}
 
-	for(const auto& timing: timings) {
-		std::cout << static_cast<double>(timing) / min_time << "; ";
-	}
 
-	std::cout << "\n";
+// Every int of the critical section is atomic: the cache lines still
+// bounce, but nobody ever waits for a lock holder. There's no lock, so
+// --lock-layout doesn't apply.
+test_result run_atomic_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	critical_section cs(options);
+	std::vector<std::atomic<int>> shared_data(cs.extent);
+
+	test_result result = run_workers(options, threadCount, perfCount,
+		[&](int, thread_probe&) {
+			unlocked_func(perfCount, outOfBusyLoopCount, [&]() {
+				for (size_t offset: cs.writes) {
+					shared_data[offset].fetch_add(1, std::memory_order_relaxed);
+				}
+				int seen = 0;
+				for (size_t offset: cs.reads) {
+					seen += shared_data[offset].load(std::memory_order_relaxed);
+				}
+				return seen;
+			});
+		});
+	checkParagon(options, checkSharedData(cs, shared_data), threadCount, perfCount, cs.writes.size());
+	return result;
 }
 
 
-struct test_params
+// Every thread runs the critical section on its own copy of the data,
+// merged only when reading the total: no sharing at all, the best any
+// layout can do.
+test_result run_sharded_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
 {
-	int threadCount;
-	int perfCount;
-	int outOfBusyLoopCount;
+	critical_section cs(options);
+	sharded_data shards(cs, threadCount);
+
+	test_result result = run_workers(options, threadCount, perfCount,
+		[&](int i, thread_probe&) {
+			int* shard = shards.shard(i);
+			unlocked_func(perfCount, outOfBusyLoopCount, [&]() {
+				for (size_t offset: cs.writes) {
+					// Keeps the compiler from folding the whole loop into one add.
+					store_slot(shard[offset], shard[offset] + 1);
+				}
+				int seen = 0;
+				for (size_t offset: cs.reads) {
+					seen += load_slot(shard[offset]);
+				}
+				return seen;
+			});
+		});
+	checkParagon(options, checkSharedData(cs, shards), threadCount, perfCount, cs.writes.size());
+	return result;
+}
+
+
+// Read-mostly workload: each operation either reads the slots check_func
+// increments (under a shared lock), or increments them (exclusively).
+
+// Per-thread outcome of the read-mostly workload.
+struct alignas(CACHE_LINE_SIZE) rw_counts
+{
+	long long reads{0};
+	long long writes{0};
+	// Reads that saw a write half done: they'd mean a broken lock.
+	long long torn_reads{0};
 };
 
 
-auto generate_tests()
+// Every write increments all the slots, so a consistent read sees them equal.
+bool read_slots(const std::vector<int>& shared_data)
 {
-	std::vector<test_params> tests;
-	std::vector<std::pair<int, int>> lparms = {
-			{10000000, 0},
-			{1000000, 50},
-			{ 980000, 200},
-			{ 950000, 400},
-			{ 900000, 800},
-			{ 850000, 1200},
-			{ 700000, 2000},
-			{ 400000, 10000},
-	};
+	int first = load_slot(shared_data[0]);
+	bool consistent = true;
+	for(size_t pos = 0; pos < shared_data.size(); pos += shared_data.size()/CHANGE_COUNT) {
+		consistent = consistent && load_slot(shared_data[pos]) == first;
+	}
+	return consistent;
+}
 
-	for(const auto& parms: lparms) {
-		for(int threadCount = 1; threadCount <= 16; ++threadCount){
-			tests.push_back({threadCount, parms.first/threadCount, parms.second});
+
+template<class rw_lock_type>
+bool locked_read(rw_lock_type& lock, const std::vector<int>& shared_data)
+{
+	std::shared_lock<rw_lock_type> guard(lock);
+	return read_slots(shared_data);
+}
+
+
+bool locked_read(SeqLock& lock, const std::vector<int>& shared_data)
+{
+	for (;;) {
+		unsigned int seq = lock.read_begin();
+		bool consistent = read_slots(shared_data);
+		if (!lock.read_retry(seq)) {
+			return consistent;
 		}
 	}
+}
 
-	return tests;
+
+template<class rw_lock_type>
+void rw_func(std::vector<int>& shared_data, rw_lock_type& lock, int perfCount, int outOfBusyLoopCount,
+		int readPercent, thread_probe& probe, rw_counts& counts) {
+	volatile int dummy = 1;
+	std::uint32_t seed = static_cast<std::uint32_t>(probe.id) * 2654435761U + 1;
+
+	for (int i = 0; i < perfCount; ++i) {
+		for (int j = 0; j < outOfBusyLoopCount; ++j) {
+			dummy = dummy + 1;
+			NOOP
+		}
+
+		// xorshift32
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		if (static_cast<int>(seed % 100) < readPercent) {
+			if (!locked_read(lock, shared_data)) {
+				++counts.torn_reads;
+			}
+			++counts.reads;
+			continue;
+		}
+
+		auto before = std::chrono::steady_clock::now();
+		lock.lock();
+		auto after = std::chrono::steady_clock::now();
+		probe.waits->record(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+		std::lock_guard<rw_lock_type> guard(lock, std::adopt_lock);
+		for(size_t pos = 0; pos < shared_data.size(); pos += shared_data.size()/CHANGE_COUNT) {
+			store_slot(shared_data[pos], shared_data[pos] + 1);
+		}
+		++counts.writes;
+	}
 }
 
 
-int main(int argc, char*[])
+template<class rw_lock_type>
+test_result run_rw_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
 {
-	auto tests = generate_tests();
+	rw_lock_type lock;
+	std::vector<int> shared_data(0x100000);
+	std::vector<rw_counts> counts(threadCount);
 
-	if(argc == 1) {
-		std::cout << "\"Threads\"; \"Iterations\"; \"Non-contended Loops\"; "
-			  << "\"Time Futex<0>\"; \"Time Futex<1>\"; \"Time Futex<40>\"; \"Time std::mutex\"; "
-			  << "\"Rel Futex<0>\"; \"Rel Futex<1>\"; \"Rel Futex<40>\"; \"Rel std::mutex\";\n";
+	// Writer latency is part of the report, not an option.
+	harness_options rw_options = options;
+	rw_options.latency = true;
+	test_result result = run_workers(rw_options, threadCount, perfCount,
+		[&](int i, thread_probe& probe) {
+			rw_func(shared_data, lock, perfCount, outOfBusyLoopCount, options.read_percent, probe, counts[i]);
+		});
+
+	rw_counts total;
+	for (const auto& count: counts) {
+		total.reads += count.reads;
+		total.writes += count.writes;
+		total.torn_reads += count.torn_reads;
 	}
-	else {
-		std::cout << "\"Threads\"; \"Iterations\"; \"Non-contended Loops\"; \"Baseline\";\n";
-	
+
+	long long fullCount = checkSharedData(shared_data);
+	long long paragon = total.writes * CHANGE_COUNT;
+	if (fullCount != paragon || total.torn_reads)
+	{
+		std::ostringstream ss;
+		ss << "Lock failed: " << fullCount << "/" << paragon << ", " << total.torn_reads << " torn reads";
+		throw std::runtime_error(ss.str().c_str());
 	}
 
-	for(const auto& tp: tests) {
-		line_test(argc > 1, tp.threadCount, tp.perfCount, tp.outOfBusyLoopCount);
+	result.workload_throughput = result.seconds > 0.0 ? total.reads / result.seconds : 0.0;
+	return result;
+}
+
+
+// Producer/consumer workload: some of the threads (see producer_count)
+// push perfCount items each through a bounded queue, the others pop them,
+// waiting on condition variables when the queue is empty or full.
+
+struct queue_item
+{
+	long long value{0};
+	std::chrono::steady_clock::time_point pushed;
+};
+
+
+template<class mutex_type, class condition_type>
+class blocking_queue {
+	mutex_type m_mutex;
+	condition_type m_not_empty;
+	condition_type m_not_full;
+	std::vector<queue_item> m_items;
+	size_t m_head{0};
+	size_t m_count{0};
+
+public:
+	explicit blocking_queue(size_t capacity): m_items(capacity) {}
+
+	void push(const queue_item& item)
+	{
+		{
+			std::unique_lock<mutex_type> lock(m_mutex);
+			while (m_count == m_items.size()) {
+				m_not_full.wait(lock);
+			}
+			m_items[(m_head + m_count) % m_items.size()] = item;
+			++m_count;
+		}
+		m_not_empty.notify_one();
 	}
-	return 0;
+
+	// Sets waited if the queue was found empty.
+	queue_item pop(bool& waited)
+	{
+		queue_item item;
+		waited = false;
+		{
+			std::unique_lock<mutex_type> lock(m_mutex);
+			while (m_count == 0) {
+				waited = true;
+				m_not_empty.wait(lock);
+			}
+			item = m_items[m_head];
+			m_head = (m_head + 1) % m_items.size();
+			--m_count;
+		}
+		m_not_full.notify_one();
+		return item;
+	}
+};
+
+
+// At least one producer and one consumer, even on single thread rows.
+int producer_count(const harness_options& options, int threadCount)
+{
+	int producers = options.producers ? options.producers : threadCount / 2;
+	return std::max(1, std::min(producers, threadCount - 1));
+}
+
+int consumer_count(const harness_options& options, int threadCount)
+{
+	return std::max(1, threadCount - producer_count(options, threadCount));
+}
+
+
+// Items consumer number consumer pops: they're dealt evenly.
+long long consumer_share(long long items, int consumers, int consumer)
+{
+	return items / consumers + (consumer < items % consumers ? 1 : 0);
+}
+
+
+// Throws if the consumers didn't get exactly what the producers pushed:
+// perfCount items each, valued the producer index + 1.
+void checkConsumedItems(const std::vector<long long>& consumed, int producers, int perfCount)
+{
+	long long fullCount = 0;
+	for (long long value: consumed) {
+		fullCount += value;
+	}
+	long long paragon = static_cast<long long>(perfCount) * producers * (producers + 1) / 2;
+	if (fullCount != paragon)
+	{
+		std::ostringstream ss;
+		ss << "Lock failed: " << fullCount << "/" << paragon;
+		throw std::runtime_error(ss.str().c_str());
+	}
+}
+
+
+template<class mutex_type, class condition_type>
+test_result run_queue_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	blocking_queue<mutex_type, condition_type> queue(options.queue_capacity);
+	int producers = producer_count(options, threadCount);
+	int consumers = consumer_count(options, threadCount);
+	long long items = static_cast<long long>(producers) * perfCount;
+	std::vector<long long> consumed(producers + consumers);
+
+	// Wakeup latency is part of the report, not an option.
+	harness_options queue_options = options;
+	queue_options.latency = true;
+	test_result result = run_workers(queue_options, producers + consumers, perfCount,
+		[&](int i, thread_probe& probe) {
+			volatile int dummy = 1;
+			if (i < producers) {
+				for (int n = 0; n < perfCount; ++n) {
+					for (int j = 0; j < outOfBusyLoopCount; ++j) {
+						dummy = dummy + 1;
+						NOOP
+					}
+					queue.push({i + 1, std::chrono::steady_clock::now()});
+				}
+				return;
+			}
+
+			long long share = consumer_share(items, consumers, i - producers);
+			probe.operations = share;
+			for (long long n = 0; n < share; ++n) {
+				bool waited;
+				queue_item item = queue.pop(waited);
+				if (waited) {
+					// How long the item waited for the consumer to wake up.
+					auto now = std::chrono::steady_clock::now();
+					probe.waits->record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - item.pushed).count());
+				}
+				consumed[i] += item.value;
+				for (int j = 0; j < outOfBusyLoopCount; ++j) {
+					dummy = dummy + 1;
+					NOOP
+				}
+			}
+		});
+
+	checkConsumedItems(consumed, producers, perfCount);
+	result.workload_throughput = result.seconds > 0.0 ? items / result.seconds : 0.0;
+	return result;
+}
+
+
+// Pipeline workload: the same exchange through a LockedRing or MpmcRing
+// (see bounded-queue.h), retrying when it's full or empty instead of
+// waiting. Every item's latency, from push to pop, is recorded.
+template<class queue_type>
+test_result run_pipeline_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	queue_type queue(options.queue_capacity);
+	int producers = producer_count(options, threadCount);
+	int consumers = consumer_count(options, threadCount);
+	long long items = static_cast<long long>(producers) * perfCount;
+	std::vector<long long> consumed(producers + consumers);
+
+	harness_options pipeline_options = options;
+	pipeline_options.latency = true;
+	test_result result = run_workers(pipeline_options, producers + consumers, perfCount,
+		[&](int i, thread_probe& probe) {
+			volatile int dummy = 1;
+			SpinWait spin;
+			if (i < producers) {
+				for (int n = 0; n < perfCount; ++n) {
+					for (int j = 0; j < outOfBusyLoopCount; ++j) {
+						dummy = dummy + 1;
+						NOOP
+					}
+					queue_item item{i + 1, std::chrono::steady_clock::now()};
+					while (!queue.try_push(item)) {
+						spin();
+					}
+				}
+				return;
+			}
+
+			long long share = consumer_share(items, consumers, i - producers);
+			probe.operations = share;
+			for (long long n = 0; n < share; ++n) {
+				queue_item item;
+				while (!queue.try_pop(item)) {
+					spin();
+				}
+				auto now = std::chrono::steady_clock::now();
+				probe.waits->record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - item.pushed).count());
+				consumed[i] += item.value;
+				for (int j = 0; j < outOfBusyLoopCount; ++j) {
+					dummy = dummy + 1;
+					NOOP
+				}
+			}
+		});
+
+	checkConsumedItems(consumed, producers, perfCount);
+	result.workload_throughput = result.seconds > 0.0 ? items / result.seconds : 0.0;
+	return result;
+}
+
+
+// Coroutine workload: check_func's loop in options.tasks tasks sharing the
+// row's iterations, either as coroutines locking an AsyncMutex on a pool
+// of threadCount threads, or each on a thread of its own with a blocking
+// lock. Threads is the pool size; the thread-per-task locks don't use it.
+
+int task_iterations(const harness_options& options, int threadCount, int perfCount)
+{
+	long long total = static_cast<long long>(perfCount) * threadCount;
+	return static_cast<int>(std::max(1LL, total / options.tasks));
 }
 
+
+DetachedTask lock_task(ThreadPool& pool, AsyncMutex& mutex, const critical_section& cs, int* data,
+		int perfCount, int outOfBusyLoopCount, LatencyHistogram* waits, TaskLatch& done)
+{
+	co_await pool.schedule();
+	volatile int dummy = 1;
+	int seen = 0;
+
+	for (int i = 0; i < perfCount; ++i) {
+		for (int j = 0; j < outOfBusyLoopCount; ++j) {
+			dummy = dummy + 1;
+			NOOP
+		}
+
+		if (waits) {
+			auto before = std::chrono::steady_clock::now();
+			co_await mutex.lock();
+			auto after = std::chrono::steady_clock::now();
+			waits->record(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+		}
+		else {
+			co_await mutex.lock();
+		}
+		seen += cs.run(data);
+		mutex.unlock();
+	}
+	dummy = seen;
+	done.count_down();
+}
+
+
+// Only the time, throughput and lock waits are measured: the pool threads
+// aren't pinned nor counted.
+test_result run_async_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	critical_section cs(options);
+	std::vector<int> shared_data(cs.extent);
+	AsyncMutex mutex;
+	int iterations = task_iterations(options, threadCount, perfCount);
+	std::vector<LatencyHistogram> waits(options.latency ? options.tasks : 0);
+	TaskLatch done(options.tasks);
+
+	test_result result;
+	{
+		ThreadPool pool(threadCount);
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < options.tasks; ++i) {
+			lock_task(pool, mutex, cs, shared_data.data(), iterations, outOfBusyLoopCount,
+					options.latency ? &waits[i] : nullptr, done);
+		}
+		done.wait();
+		auto after = std::chrono::steady_clock::now();
+
+		result.seconds = std::chrono::duration<double>(after - start).count();
+		result.millis = std::chrono::duration_cast<std::chrono::milliseconds>(after - start).count();
+	}
+	result.throughput = result.seconds > 0.0
+			? static_cast<double>(iterations) * options.tasks / result.seconds : 0.0;
+	for (const auto& task_waits: waits) {
+		result.waits.merge(task_waits);
+	}
+
+	checkParagon(options, checkSharedData(cs, shared_data.data()), options.tasks, iterations, cs.writes.size());
+	return result;
+}
+
+
+template<class mutex_type>
+test_result run_thread_per_task_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	return performance_test<mutex_type>(options, options.tasks, task_iterations(options, threadCount, perfCount),
+			outOfBusyLoopCount);
+}
+
+
+template<class mutex_type>
+test_result run_lock_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	return performance_test<mutex_type>(options, threadCount, perfCount, outOfBusyLoopCount);
+}
+
+
+template<class executor_type>
+test_result run_delegation_test(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	critical_section cs(options);
+	std::vector<int> shared_data(cs.extent);
+	test_result result;
+	{
+		executor_type executor(threadCount);
+		result = run_workers(options, threadCount, perfCount,
+			[&](int, thread_probe& probe) {
+				delegate_func(cs, shared_data.data(), executor, perfCount, outOfBusyLoopCount, probe);
+			});
+	}
+	checkParagon(options, checkSharedData(cs, shared_data.data()), threadCount, perfCount, cs.writes.size());
+	return result;
+}
+
+
+struct lock_test
+{
+	const char* name;
+	test_result (*run)(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount);
+};
+
+
+// Every lock type in the comparison; the order is the order of the CSV columns.
+const std::vector<lock_test>& lock_tests()
+{
+	static const std::vector<lock_test> tests = {
+		{"Futex<0>", run_lock_test<Futex<0>>},
+		{"Futex<1>", run_lock_test<Futex<1>>},
+		{"Futex<40>", run_lock_test<Futex<0x40>>},
+		{"Futex<Pause>", run_lock_test<BasicFutex<PauseBackoff>>},
+		{"Futex<Exponential>", run_lock_test<BasicFutex<ExponentialBackoff<>>>},
+		{"Futex<SpinThenYield>", run_lock_test<BasicFutex<SpinThenYieldBackoff<>>>},
+		{"Futex<SpinThenPark>", run_lock_test<BasicFutex<SpinThenParkBackoff<>>>},
+		{"ParkingFutex", run_lock_test<ParkingFutex>},
+		{"AdaptiveFutex", run_lock_test<AdaptiveFutex>},
+		{"TicketLock", run_lock_test<TicketLock>},
+		{"McsLock", run_lock_test<McsLock>},
+		{"ClhLock", run_lock_test<ClhLock>},
+		{"CohortLock", run_lock_test<CohortLock<>>},
+		{"FlatCombining", run_delegation_test<FlatCombiner>},
+		{"Ffwd", run_delegation_test<DelegationServer>},
+		{"std::mutex", run_lock_test<std::mutex>},
+		{"AtomicAdd", run_atomic_test},
+		{"Sharded", run_sharded_test},
+	};
+	return tests;
+}
+
+
+// The reader-writer locks compared by the read-mostly workload (--rw).
+const std::vector<lock_test>& rw_lock_tests()
+{
+	static const std::vector<lock_test> tests = {
+		{"RwSpinLock", run_rw_test<RwSpinLock>},
+		{"ParkingRwLock", run_rw_test<ParkingRwLock>},
+		{"SeqLock", run_rw_test<SeqLock>},
+		{"std::shared_mutex", run_rw_test<std::shared_mutex>},
+	};
+	return tests;
+}
+
+
+// The lock and condition variable pairs compared by the producer/consumer
+// workload (--prodcons).
+const std::vector<lock_test>& queue_tests()
+{
+	static const std::vector<lock_test> tests = {
+		{"Futex<1>+FutexCondition", run_queue_test<Futex<1>, FutexCondition>},
+		{"ParkingFutex+FutexCondition", run_queue_test<ParkingFutex, FutexCondition>},
+		{"std::mutex+FutexCondition", run_queue_test<std::mutex, FutexCondition>},
+		{"std::mutex+std::condition_variable", run_queue_test<std::mutex, std::condition_variable>},
+	};
+	return tests;
+}
+
+
+// The queues compared by the pipeline workload (--pipeline).
+const std::vector<lock_test>& pipeline_tests()
+{
+	static const std::vector<lock_test> tests = {
+		{"Futex<0>", run_pipeline_test<LockedRing<queue_item, Futex<0>>>},
+		{"Futex<1>", run_pipeline_test<LockedRing<queue_item, Futex<1>>>},
+		{"Futex<40>", run_pipeline_test<LockedRing<queue_item, Futex<0x40>>>},
+		{"std::mutex", run_pipeline_test<LockedRing<queue_item, std::mutex>>},
+		{"MpmcRing", run_pipeline_test<MpmcRing<queue_item>>},
+	};
+	return tests;
+}
+
+
+// The coroutine lock and the blocking ones it's compared with (--coroutines).
+const std::vector<lock_test>& coroutine_tests()
+{
+	static const std::vector<lock_test> tests = {
+		{"AsyncMutex", run_async_test},
+		{"Futex<1>", run_thread_per_task_test<Futex<1>>},
+		{"std::mutex", run_thread_per_task_test<std::mutex>},
+	};
+	return tests;
+}
+
+
+const std::vector<lock_test>& workload_tests(Workload workload)
+{
+	switch (workload) {
+	case Workload::READ_MOSTLY:
+		return rw_lock_tests();
+	case Workload::PRODUCER_CONSUMER:
+		return queue_tests();
+	case Workload::PIPELINE:
+		return pipeline_tests();
+	case Workload::COROUTINES:
+		return coroutine_tests();
+	default:
+		return lock_tests();
+	}
+}
+
+
+// The dry run goes through the very same harness, without locking.
+const lock_test& baseline_test()
+{
+	static const lock_test baseline = {"Baseline", run_lock_test<Futex<DRY_RUN>>};
+	return baseline;
+}
+
+
+// The lock tests picked on the command line, in lock_tests() order.
+std::vector<const lock_test*> selected_tests(const harness_options& options)
+{
+	std::vector<const lock_test*> selected;
+	if (options.dry_run) {
+		selected.push_back(&baseline_test());
+		return selected;
+	}
+
+	const auto& available = workload_tests(options.workload);
+	for (const auto& name: options.locks) {
+		bool known = false;
+		for (const auto& test: available) {
+			known = known || name == test.name;
+		}
+		if (!known) {
+			throw std::invalid_argument("unknown lock \"" + name + "\" (see --list-locks)");
+		}
+	}
+	// Oversubscribed, the whole list takes ages: by default, only compare
+	// the test-and-set locks with std::mutex.
+	std::vector<std::string> names = options.locks;
+	if (names.empty() && !options.oversubscribe.empty() && options.workload == Workload::LOCK) {
+		names = {"Futex<0>", "Futex<1>", "Futex<40>", "std::mutex"};
+	}
+	for (const auto& test: available) {
+		if (names.empty()
+				|| std::find(names.begin(), names.end(), test.name) != names.end()) {
+			selected.push_back(&test);
+		}
+	}
+	return selected;
+}
+
+
+// All the measurements of one lock in a configuration.
+struct lock_timing
+{
+	const lock_test* test;
+	std::vector<long long> runs;
+	long long median{0};
+	long long min{0};
+	double stddev{0.0};
+	// The run that gave the median; the instrumentation reported is its own.
+	test_result median_run;
+};
+
+
+auto all_timings(const harness_options& options, const std::vector<const lock_test*>& tests,
+		int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	std::vector<lock_timing> timings(tests.size());
+	std::vector<std::vector<test_result>> results(tests.size());
+
+	// Interleaved, so that slow drifts of the machine hit all the locks alike.
+	for (int rep = 0; rep < options.repeat; ++rep) {
+		for (size_t i = 0; i < tests.size(); ++i) {
+			results[i].push_back(tests[i]->run(options, threadCount, perfCount, outOfBusyLoopCount));
+		}
+	}
+
+	for (size_t i = 0; i < tests.size(); ++i) {
+		auto& timing = timings[i];
+		timing.test = tests[i];
+
+		std::vector<size_t> order(results[i].size());
+		double mean = 0.0;
+		for (size_t rep = 0; rep < order.size(); ++rep) {
+			order[rep] = rep;
+			timing.runs.push_back(results[i][rep].millis);
+			mean += results[i][rep].millis;
+		}
+		mean /= order.size();
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return results[i][a].millis < results[i][b].millis;
+		});
+
+		// For even counts, the lower middle: it has to be an actual run.
+		size_t median = order[(order.size() - 1) / 2];
+		timing.median = results[i][median].millis;
+		timing.min = results[i][order.front()].millis;
+		double variance = 0.0;
+		for (long long run: timing.runs) {
+			variance += (run - mean) * (run - mean);
+		}
+		timing.stddev = std::sqrt(variance / timing.runs.size());
+		timing.median_run = std::move(results[i][median]);
+	}
+
+	return timings;
+}
+
+
+// Whether the workload reports a rate and wait percentiles of its own.
+bool has_workload_rate(Workload workload)
+{
+	return workload == Workload::READ_MOSTLY
+			|| workload == Workload::PRODUCER_CONSUMER
+			|| workload == Workload::PIPELINE;
+}
+
+
+void csv_header(const harness_options& options, const std::vector<const lock_test*>& tests)
+{
+	std::cout << "\"Threads\"; \"Iterations\"; \"Non-contended Loops\"; \"Placement\"; ";
+	if (options.dry_run) {
+		// Historically, the dry run has no relative column header.
+		std::cout << "\"Baseline\"; ";
+	}
+	else {
+		for (const auto* test: tests) {
+			std::cout << "\"Time " << test->name << "\"; ";
+		}
+		for (const auto* test: tests) {
+			std::cout << "\"Rel " << test->name << "\"; ";
+		}
+	}
+	if (options.repeat > 1) {
+		for (const auto* test: tests) {
+			std::cout << "\"Min " << test->name << "\"; "
+					  << "\"Stddev " << test->name << "\"; ";
+		}
+	}
+	if (options.throughput) {
+		for (const auto* test: tests) {
+			std::cout << "\"Acq/s " << test->name << "\"; "
+					  << "\"Thread acq/s " << test->name << "\"; "
+					  << "\"Min thread acq/s " << test->name << "\"; ";
+		}
+	}
+	if (has_workload_rate(options.workload)) {
+		bool rw = options.workload == Workload::READ_MOSTLY;
+		const char* rate = rw ? "Reads/s " : "Items/s ";
+		const char* wait = rw ? "Write wait "
+				: options.workload == Workload::PIPELINE ? "Item latency " : "Wakeup ";
+		for (const auto* test: tests) {
+			std::cout << "\"" << rate << test->name << "\"; "
+					  << "\"" << wait << "p50 ns " << test->name << "\"; "
+					  << "\"" << wait << "p99 ns " << test->name << "\"; "
+					  << "\"" << wait << "max ns " << test->name << "\"; ";
+		}
+	}
+	if (options.latency) {
+		for (const auto* test: tests) {
+			std::cout << "\"Wait p50 ns " << test->name << "\"; "
+					  << "\"Wait p99 ns " << test->name << "\"; "
+					  << "\"Wait p99.9 ns " << test->name << "\"; "
+					  << "\"Wait max ns " << test->name << "\"; ";
+		}
+	}
+	if (options.fairness) {
+		for (const auto* test: tests) {
+			std::cout << "\"Thread done ms " << test->name << "\"; "
+					  << "\"Longest streak " << test->name << "\"; "
+					  << "\"Jain index " << test->name << "\"; ";
+		}
+	}
+	if (options.perf) {
+		for (const auto* test: tests) {
+			for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+				std::cout << "\"" << PerfCounters::name(i) << " " << test->name << "\"; ";
+			}
+		}
+	}
+	std::cout << "\n";
+}
+
+
+double min_median(const std::vector<lock_timing>& timings)
+{
+	double min_time = 9999999999.0;
+	for(const auto& timing: timings) {
+		if (static_cast<double>(timing.median) < min_time && timing.median > 0.0) {
+			min_time = static_cast<double>(timing.median);
+		}
+	}
+	return min_time;
+}
+
+
+void csv_row(const harness_options& options, const std::vector<lock_timing>& timings)
+{
+	double min_time = min_median(timings);
+	for(const auto& timing: timings) {
+		std::cout << timing.median << "; ";
+	}
+
+	for(const auto& timing: timings) {
+		std::cout << static_cast<double>(timing.median) / min_time << "; ";
+	}
+
+	if (options.repeat > 1) {
+		for(const auto& timing: timings) {
+			std::cout << timing.min << "; " << timing.stddev << "; ";
+		}
+	}
+
+	if (options.throughput) {
+		for(const auto& timing: timings) {
+			std::cout << static_cast<long long>(timing.median_run.throughput) << "; "
+					  << static_cast<long long>(timing.median_run.thread_throughput) << "; "
+					  << static_cast<long long>(timing.median_run.min_thread_throughput) << "; ";
+		}
+	}
+
+	if (has_workload_rate(options.workload)) {
+		for(const auto& timing: timings) {
+			const auto& waits = timing.median_run.waits;
+			std::cout << static_cast<long long>(timing.median_run.workload_throughput) << "; "
+					  << waits.percentile(50) << "; "
+					  << waits.percentile(99) << "; "
+					  << waits.max() << "; ";
+		}
+	}
+
+	if (options.latency) {
+		for(const auto& timing: timings) {
+			const auto& waits = timing.median_run.waits;
+			std::cout << waits.percentile(50) << "; "
+					  << waits.percentile(99) << "; "
+					  << waits.percentile(99.9) << "; "
+					  << waits.max() << "; ";
+		}
+	}
+
+	if (options.fairness) {
+		for(const auto& timing: timings) {
+			const char* sep = "";
+			for (double ms: timing.median_run.finish_ms) {
+				std::cout << sep << static_cast<long long>(ms);
+				sep = "/";
+			}
+			std::cout << "; " << timing.median_run.longest_streak << "; " << timing.median_run.jain << "; ";
+		}
+	}
+
+	if (options.perf) {
+		for(const auto& timing: timings) {
+			for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+				if (timing.median_run.perf.valid[i]) {
+					std::cout << timing.median_run.perf.values[i] << "; ";
+				}
+				else {
+					std::cout << "n/a; ";
+				}
+			}
+		}
+	}
+
+	std::cout << "\n";
+}
+
+
+std::string json_string(const std::string& text)
+{
+	std::string quoted = "\"";
+	for (char chr: text) {
+		if (chr == '"' || chr == '\\') {
+			quoted += '\\';
+		}
+		quoted += chr;
+	}
+	return quoted + "\"";
+}
+
+
+void json_row(const harness_options& options, int threadCount, int perfCount, int outOfBusyLoopCount,
+		const std::vector<lock_timing>& timings)
+{
+	double min_time = min_median(timings);
+	std::cout << "    {\"threads\": " << threadCount
+			  << ", \"iterations\": " << perfCount
+			  << ", \"busy_loops\": " << outOfBusyLoopCount
+			  << ", \"locks\": [";
+
+	const char* sep = "\n";
+	for (const auto& timing: timings) {
+		const auto& run = timing.median_run;
+		std::cout << sep << "      {\"name\": " << json_string(timing.test->name)
+				  << ", \"median_ms\": " << timing.median
+				  << ", \"min_ms\": " << timing.min
+				  << ", \"stddev_ms\": " << timing.stddev
+				  << ", \"rel\": " << static_cast<double>(timing.median) / min_time
+				  << ", \"runs_ms\": [";
+		for (size_t i = 0; i < timing.runs.size(); ++i) {
+			std::cout << (i ? ", " : "") << timing.runs[i];
+		}
+		std::cout << "]"
+				  << ", \"acquisitions_per_s\": " << static_cast<long long>(run.throughput)
+				  << ", \"thread_acquisitions_per_s\": " << static_cast<long long>(run.thread_throughput)
+				  << ", \"min_thread_acquisitions_per_s\": " << static_cast<long long>(run.min_thread_throughput);
+
+		if (has_workload_rate(options.workload)) {
+			bool rw = options.workload == Workload::READ_MOSTLY;
+			std::cout << (rw ? ", \"reads_per_s\": " : ", \"items_per_s\": ")
+					  << static_cast<long long>(run.workload_throughput)
+					  << (rw ? ", \"write_wait_ns\": "
+							: options.workload == Workload::PIPELINE ? ", \"item_latency_ns\": " : ", \"wakeup_ns\": ")
+					  << "{\"p50\": " << run.waits.percentile(50)
+					  << ", \"p99\": " << run.waits.percentile(99)
+					  << ", \"max\": " << run.waits.max() << "}";
+		}
+		if (options.latency) {
+			std::cout << ", \"wait_ns\": {\"p50\": " << run.waits.percentile(50)
+					  << ", \"p99\": " << run.waits.percentile(99)
+					  << ", \"p99.9\": " << run.waits.percentile(99.9)
+					  << ", \"max\": " << run.waits.max() << "}";
+		}
+		if (options.fairness) {
+			std::cout << ", \"thread_done_ms\": [";
+			for (size_t i = 0; i < run.finish_ms.size(); ++i) {
+				std::cout << (i ? ", " : "") << run.finish_ms[i];
+			}
+			std::cout << "], \"longest_streak\": " << run.longest_streak
+					  << ", \"jain_index\": " << run.jain;
+		}
+		if (options.perf) {
+			std::cout << ", \"counters\": {";
+			for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+				std::cout << (i ? ", " : "") << json_string(PerfCounters::name(i)) << ": ";
+				if (run.perf.valid[i]) {
+					std::cout << run.perf.values[i];
+				}
+				else {
+					std::cout << "null";
+				}
+			}
+			std::cout << "}";
+		}
+		std::cout << "}";
+		sep = ",\n";
+	}
+	std::cout << "\n    ]}";
+}
+
+
+void line_test(const harness_options& options, const std::vector<const lock_test*>& tests,
+		int threadCount, int perfCount, int outOfBusyLoopCount)
+{
+	if (options.format == OutputFormat::CSV) {
+		std::cout << threadCount << "; "
+				  << perfCount << "; "
+				  << outOfBusyLoopCount << "; "
+				  << placement_name(options.placement) << "; "
+				  << std::flush;
+	}
+
+	auto timings = all_timings(options, tests, threadCount, perfCount, outOfBusyLoopCount);
+
+	if (options.format == OutputFormat::CSV) {
+		csv_row(options, timings);
+	}
+	else {
+		json_row(options, threadCount, perfCount, outOfBusyLoopCount, timings);
+	}
+}
+
+
+struct test_params
+{
+	int threadCount;
+	int perfCount;
+	int outOfBusyLoopCount;
+};
+
+
+auto generate_tests(const harness_options& options)
+{
+	std::vector<test_params> tests;
+	// {total iterations, non-contended loops}
+	std::vector<std::pair<long long, int>> lparms = {
+			{10000000, 0},
+			{1000000, 50},
+			{ 980000, 200},
+			{ 950000, 400},
+			{ 900000, 800},
+			{ 850000, 1200},
+			{ 700000, 2000},
+			{ 400000, 10000},
+	};
+
+	if (!options.busy_loops.empty() || options.iterations) {
+		std::vector<std::pair<long long, int>> custom;
+		if (options.busy_loops.empty()) {
+			for (const auto& parms: lparms) {
+				custom.push_back({options.iterations, parms.second});
+			}
+		}
+		for (int loops: options.busy_loops) {
+			long long iterations = options.iterations ? options.iterations : 1000000;
+			for (const auto& parms: lparms) {
+				if (!options.iterations && parms.second == loops) {
+					iterations = parms.first;
+				}
+			}
+			custom.push_back({iterations, loops});
+		}
+		lparms = custom;
+	}
+
+	std::vector<int> threads = options.threads;
+	if (threads.empty()) {
+		for(int threadCount = 1; threadCount <= 16; ++threadCount){
+			threads.push_back(threadCount);
+		}
+	}
+
+	for(const auto& parms: lparms) {
+		for(int threadCount: threads){
+			long long perfCount = std::max(1LL, parms.first/threadCount);
+			tests.push_back({threadCount, static_cast<int>(std::min<long long>(perfCount, INT_MAX)), parms.second});
+		}
+	}
+
+	return tests;
+}
+
+
+// --check: the timed paths, which no workload takes. Each lock must time
+// out while another thread holds it, then get it when that thread lets it
+// go before the deadline.
+template<class mutex_type>
+bool check_timed_lock(const char* name)
+{
+	using std::chrono::milliseconds;
+	const auto timeout = milliseconds(20);
+	const auto patience = std::chrono::seconds(5);
+	mutex_type mutex;
+	std::atomic<bool> held{false};
+	std::atomic<bool> release{false};
+	std::thread holder([&]() {
+		mutex.lock();
+		held = true;
+		while (!release) {
+			std::this_thread::yield();
+		}
+		std::this_thread::sleep_for(timeout);
+		mutex.unlock();
+	});
+	while (!held) {
+		std::this_thread::yield();
+	}
+
+	const char* failure = nullptr;
+	auto start = std::chrono::steady_clock::now();
+	if (mutex.try_lock()) {
+		failure = "try_lock got a held lock";
+		mutex.unlock();
+	}
+	else {
+		std::unique_lock<mutex_type> expired(mutex, timeout);
+		if (expired.owns_lock()) {
+			failure = "try_lock_for got a held lock";
+		}
+		else if (std::chrono::steady_clock::now() - start < timeout) {
+			failure = "try_lock_for gave up before the timeout";
+		}
+	}
+	release = true;
+	if (!failure) {
+		start = std::chrono::steady_clock::now();
+		if (!mutex.try_lock_until(start + patience)) {
+			failure = "try_lock_until missed the release";
+		}
+		else {
+			if (std::chrono::steady_clock::now() - start >= patience) {
+				failure = "try_lock_until woke up at the deadline only";
+			}
+			mutex.unlock();
+		}
+	}
+	holder.join();
+
+	std::cout << name << ": " << (failure ? failure : "ok") << "\n";
+	return !failure;
+}
+
+
+// FutexCondition::wait_for must time out when nobody notifies, and come
+// back well before the deadline when someone does.
+template<class mutex_type>
+bool check_timed_condition(const char* name)
+{
+	const auto timeout = std::chrono::milliseconds(20);
+	const auto patience = std::chrono::seconds(5);
+	mutex_type mutex;
+	FutexCondition condition;
+	bool ready = false;
+	const char* failure = nullptr;
+
+	std::unique_lock<mutex_type> lock(mutex);
+	auto start = std::chrono::steady_clock::now();
+	if (condition.wait_for(lock, timeout) != std::cv_status::timeout) {
+		failure = "wait_for didn't time out";
+	}
+	else if (std::chrono::steady_clock::now() - start < timeout || !lock.owns_lock()) {
+		failure = "wait_for timed out early";
+	}
+
+	std::thread notifier([&]() {
+		std::this_thread::sleep_for(timeout);
+		std::lock_guard<mutex_type> guard(mutex);
+		ready = true;
+		condition.notify_one();
+	});
+	start = std::chrono::steady_clock::now();
+	// Waits may return spuriously: wait again until notified, or timed out.
+	while (!ready && condition.wait_for(lock, patience) == std::cv_status::no_timeout) {
+	}
+	if (!failure && (!ready || std::chrono::steady_clock::now() - start >= patience)) {
+		failure = "wait_for missed the notification";
+	}
+	lock.unlock();
+	notifier.join();
+
+	std::cout << name << ": " << (failure ? failure : "ok") << "\n";
+	return !failure;
+}
+
+
+bool run_checks()
+{
+	bool ok = true;
+	ok = check_timed_lock<Futex<0>>("Futex<0>") && ok;
+	ok = check_timed_lock<Futex<1>>("Futex<1>") && ok;
+	ok = check_timed_lock<BasicFutex<ExponentialBackoff<>>>("Futex<Exponential>") && ok;
+	ok = check_timed_lock<BasicFutex<SpinThenParkBackoff<>>>("Futex<SpinThenPark>") && ok;
+	ok = check_timed_lock<ParkingFutex>("ParkingFutex") && ok;
+	ok = check_timed_condition<ParkingFutex>("ParkingFutex+FutexCondition") && ok;
+	ok = check_timed_condition<std::mutex>("std::mutex+FutexCondition") && ok;
+	return ok;
+}
+
+
+int main(int argc, char* argv[])
+{
+	harness_options options;
+	std::vector<const lock_test*> locks;
+	try {
+		options = parse_command_line(argc, argv);
+		locks = selected_tests(options);
+	}
+	catch (const std::exception& e) {
+		std::cerr << argv[0] << ": " << e.what() << "\n";
+		print_usage(std::cerr, argv[0]);
+		return 1;
+	}
+
+	if (options.help) {
+		print_usage(std::cout, argv[0]);
+		return 0;
+	}
+	if (options.list_locks) {
+		for (const auto& test: workload_tests(options.workload)) {
+			std::cout << test.name << "\n";
+		}
+		return 0;
+	}
+	if (options.check) {
+		return run_checks() ? 0 : 1;
+	}
+
+	// Before anything else starts a thread, as the restriction is inherited.
+	if (options.cpus && !restrict_process_cpus(options.cpus)) {
+		std::cerr << argv[0] << ": cannot restrict the process to " << options.cpus << " CPUs\n";
+		return 1;
+	}
+	if (!options.oversubscribe.empty()) {
+		auto cpus = static_cast<int>(read_cpu_topology().size());
+		if (!cpus) {
+			cpus = std::max(1U, std::thread::hardware_concurrency());
+		}
+		for (int factor: options.oversubscribe) {
+			options.threads.push_back(factor * cpus);
+		}
+	}
+
+	if (options.cohort_nodes >= 0) {
+		NodeMap::instance().configure(read_cpu_topology(), options.cohort_nodes);
+	}
+
+	if (options.placement != Placement::NONE) {
+		options.cpu_order = placement_order(options.placement, read_cpu_topology());
+		if (options.cpu_order.empty()) {
+			// Recorded as placement "none" in the results.
+			std::cerr << "CPU topology not available, threads won't be pinned\n";
+			options.placement = Placement::NONE;
+		}
+	}
+
+	if (options.perf) {
+		auto probe = PerfCounters().read();
+		for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+			if (!probe.valid[i]) {
+				std::cerr << "Counter \"" << PerfCounters::name(i) << "\" not available\n";
+			}
+		}
+	}
+
+	auto tests = generate_tests(options);
+
+	if (options.format == OutputFormat::CSV) {
+		csv_header(options, locks);
+	}
+	else {
+		std::cout << "{\n  \"placement\": " << json_string(placement_name(options.placement))
+				  << ",\n  \"repeat\": " << options.repeat
+				  << ",\n  \"dry_run\": " << (options.dry_run ? "true" : "false")
+				  << ",\n  \"cs_bytes\": " << options.cs_bytes
+				  << ",\n  \"cs_stride\": " << options.cs_stride
+				  << ",\n  \"cs_write_percent\": " << options.cs_write_percent
+				  << ",\n  \"lock_layout\": " << json_string(options.lock_shares_line ? "shared" : "padded")
+				  << ",\n  \"cpus\": " << options.cpus
+				  << ",\n  \"hogs\": " << options.hogs
+				  << ",\n  \"workload\": " << json_string(workload_name(options.workload))
+				  << ",\n  \"producers\": " << options.producers
+				  << ",\n  \"queue_capacity\": " << options.queue_capacity
+				  << ",\n  \"tasks\": " << options.tasks
+				  << ",\n  \"read_percent\": " << (options.workload == Workload::READ_MOSTLY ? options.read_percent : 0)
+				  << ",\n  \"rows\": [\n";
+	}
+
+	const char* sep = "";
+	for(const auto& tp: tests) {
+		if (options.format == OutputFormat::JSON) {
+			std::cout << sep;
+			sep = ",\n";
+		}
+		line_test(options, locks, tp.threadCount, tp.perfCount, tp.outOfBusyLoopCount);
+	}
+
+	if (options.format == OutputFormat::JSON) {
+		std::cout << "\n  ]\n}\n";
+	}
+	return 0;
+}
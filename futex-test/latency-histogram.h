@@ -0,0 +1,99 @@
+/* Log-linear latency histogram, in the style of HdrHistogram.
+
+   Values (nanoseconds) are bucketed by their power of two, and each power of
+   two is split into SUB_BUCKETS linear sub-buckets, so every recorded value
+   is known within 1/SUB_BUCKETS (~3%) of its magnitude, from single
+   nanoseconds up to minutes, in a fixed array.
+
+   Recording is a couple of shifts and an increment on a private array: no
+   atomics, no allocation. Each thread is meant to fill its own histogram,
+   and the histograms are merged once the threads are done.
+*/
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "lock-utils.h"
+
+class alignas(CACHE_LINE_SIZE) LatencyHistogram {
+   static constexpr unsigned int SUB_BUCKET_BITS = 5;
+   static constexpr std::uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+   // Values below 2*SUB_BUCKETS are stored exactly, then come SUB_BUCKETS
+   // buckets for each further power of two, up to 2^63.
+   static constexpr std::size_t BUCKET_COUNT = (65 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+   std::array<std::uint64_t, BUCKET_COUNT> m_counts{};
+   std::uint64_t m_total{0};
+   std::uint64_t m_max{0};
+
+   static unsigned int msb(std::uint64_t value) noexcept {
+      unsigned int bit = 0;
+      while (value >>= 1) {
+         ++bit;
+      }
+      return bit;
+   }
+
+   static std::size_t index_of(std::uint64_t value) noexcept {
+      if (value < 2 * SUB_BUCKETS) {
+         return static_cast<std::size_t>(value);
+      }
+#if defined(__GNUC__)
+      unsigned int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+#else
+      unsigned int shift = msb(value) - SUB_BUCKET_BITS;
+#endif
+      return static_cast<std::size_t>((shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS));
+   }
+
+   // Highest value that would land in the given bucket.
+   static std::uint64_t highest_of(std::size_t index) noexcept {
+      if (index < 2 * SUB_BUCKETS) {
+         return index;
+      }
+      unsigned int shift = static_cast<unsigned int>(index / SUB_BUCKETS - 1);
+      std::uint64_t top = index % SUB_BUCKETS + SUB_BUCKETS;
+      return ((top + 1) << shift) - 1;
+   }
+
+public:
+   void record(std::uint64_t value) noexcept {
+      ++m_counts[index_of(value)];
+      ++m_total;
+      if (value > m_max) {
+         m_max = value;
+      }
+   }
+
+   void merge(const LatencyHistogram& other) noexcept {
+      for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+         m_counts[i] += other.m_counts[i];
+      }
+      m_total += other.m_total;
+      m_max = std::max(m_max, other.m_max);
+   }
+
+   std::uint64_t count() const noexcept { return m_total; }
+   std::uint64_t max() const noexcept { return m_max; }
+
+   // Value at or below which the given percentage (0-100) of the samples
+   // fall; like HdrHistogram, reports the top of the matching bucket.
+   std::uint64_t percentile(double pct) const noexcept {
+      if (m_total == 0) {
+         return 0;
+      }
+      auto wanted = static_cast<std::uint64_t>(pct / 100.0 * static_cast<double>(m_total) + 0.5);
+      wanted = std::min(std::max<std::uint64_t>(wanted, 1), m_total);
+
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+         seen += m_counts[i];
+         if (seen >= wanted) {
+            return std::min(highest_of(i), m_max);
+         }
+      }
+      return m_max;
+   }
+};
@@ -0,0 +1,52 @@
+/* Small helpers shared by the lock implementations. */
+#pragma once
+
+#include <cstddef>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// std::hardware_destructive_interference_size is still patchy across
+// compilers (and GCC warns about ABI stability when using it), so we pin
+// the common x86/ARM value.
+constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+// Tells the CPU we're in a spin-wait loop: PAUSE on x86, YIELD on ARM.
+// It saves power, frees resources for the SMT sibling and avoids the
+// memory-order mis-speculation flush when the awaited line changes.
+inline void cpu_relax() noexcept
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+   _mm_pause();
+#elif defined(_MSC_VER) && (defined(_M_ARM) || defined(_M_ARM64))
+   __yield();
+#elif defined(__i386__) || defined(__x86_64__)
+   _mm_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+   asm volatile("yield" ::: "memory");
+#else
+   asm volatile("" ::: "memory");
+#endif
+}
+
+
+// Spin-wait step for locks that hand over to one specific waiter: relaxes,
+// and every so often yields, in case whoever we're waiting for has been
+// preempted (which would otherwise stall the whole queue for a time slice).
+class SpinWait {
+   unsigned int m_count{0};
+
+public:
+   void operator()() noexcept {
+      if (++m_count % 1024 == 0) {
+         std::this_thread::yield();
+      }
+      else {
+         cpu_relax();
+      }
+   }
+};
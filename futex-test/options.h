@@ -0,0 +1,380 @@
+/* Command line of the lock benchmark. */
+#pragma once
+
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "placement.h"
+
+// What the workers do with the locks.
+enum class Workload {
+   // Increment the shared counters under the lock (the historical test).
+   LOCK,
+   // Mostly read them under a reader-writer lock (--rw).
+   READ_MOSTLY,
+   // Pass items through a bounded queue guarded by a lock and two
+   // condition variables (--prodcons).
+   PRODUCER_CONSUMER,
+   // Pass items through a bounded queue that is never waited on: each
+   // lock type guarding a ring buffer, and a lock-free ring (--pipeline).
+   PIPELINE,
+   // Lock from many coroutines on a small ThreadPool, against one thread
+   // per task (--coroutines).
+   COROUTINES
+};
+
+
+inline const char* workload_name(Workload workload)
+{
+	switch (workload) {
+	case Workload::LOCK: return "lock";
+	case Workload::READ_MOSTLY: return "read-mostly";
+	case Workload::PRODUCER_CONSUMER: return "producer-consumer";
+	case Workload::PIPELINE: return "pipeline";
+	case Workload::COROUTINES: return "coroutines";
+	}
+	return "unknown";
+}
+
+
+enum class OutputFormat {
+   CSV,
+   JSON
+};
+
+
+struct harness_options
+{
+	bool dry_run{false};
+	// Adds aggregate and per-thread acquisitions/s to the CSV.
+	bool throughput{false};
+	// Records how long each lock() waited, see check_func.
+	bool latency{false};
+	// Tracks per-thread completion and acquisition streaks.
+	bool fairness{false};
+	// Counts cycles, cache misses, etc. of each worker via perf_event_open.
+	bool perf{false};
+	// Where to pin the workers: thread i goes on cpu_order[i % size].
+	Placement placement{Placement::NONE};
+	std::vector<int> cpu_order;
+	// Virtual NUMA nodes for CohortLock; 0 uses the real ones, -1 the default.
+	int cohort_nodes{-1};
+	// Oversubscription: thread counts as multiples of the CPUs available,
+	// the number of CPUs to keep the process on (0: all of them), and
+	// background threads just burning CPU during every measure.
+	std::vector<int> oversubscribe;
+	int cpus{0};
+	int hogs{0};
+
+	// The test matrix; empty/0 values mean the historical defaults.
+	std::vector<int> threads;
+	long long iterations{0};
+	std::vector<int> busy_loops;
+	// Critical section of the lock workload: how many bytes it touches, how
+	// far apart the touched ints are, the share of them that are written
+	// (the others are only read) and whether the lock word shares its cache
+	// line with the first of them. The defaults are the historical 16 ints,
+	// 256K apart, all incremented.
+	int cs_bytes{64};
+	int cs_stride{0x40000};
+	int cs_write_percent{100};
+	bool lock_shares_line{false};
+	Workload workload{Workload::LOCK};
+	// Queue workloads: how many of the threads produce (0: half of them,
+	// the rest consume) and how many items the queue holds.
+	int producers{0};
+	int queue_capacity{64};
+	// Coroutine workload: how many tasks share the iterations of a row.
+	int tasks{1000};
+	// Percentage of reads in the read-mostly workload.
+	int read_percent{90};
+	// Lock names to run; empty means all of them.
+	std::vector<std::string> locks;
+	// How many times each configuration is measured.
+	int repeat{1};
+	OutputFormat format{OutputFormat::CSV};
+
+	bool list_locks{false};
+	// Runs the timed locking checks instead of the benchmark.
+	bool check{false};
+	bool help{false};
+};
+
+
+inline void print_usage(std::ostream& out, const char* program)
+{
+	out << "Usage: " << program << " [options] [dry]\n"
+		<< "\n"
+		<< "Any non-option argument runs the harness without locking (dry run).\n"
+		<< "\n"
+		<< "Test matrix:\n"
+		<< "  --threads=LIST       thread counts, i.e. 1-16, 1,2,4,8 or 8-128:8 (default 1-16)\n"
+		<< "  --iterations=N       lock acquisitions per row, split among the threads\n"
+		<< "  --busy-loops=LIST    non-contended loops between acquisitions, i.e. 0,50,200\n"
+		<< "  --locks=NAMES        comma separated lock names (see --list-locks)\n"
+		<< "  --repeat=N           measure each configuration N times, report median/min/stddev\n"
+		<< "  --format=csv|json    output format (default csv)\n"
+		<< "  --rw                 read-mostly workload on the reader-writer locks\n"
+		<< "  --read-percent=N     share of reads in the --rw workload (default 90)\n"
+		<< "  --prodcons           producer/consumer queue on the condition variables\n"
+		<< "  --pipeline           producer/consumer ring on each lock, and lock-free\n"
+		<< "  --producers=N        producer threads of the queue workloads (default half)\n"
+		<< "  --queue-capacity=N   items the queue holds (default 64)\n"
+		<< "  --coroutines         AsyncMutex tasks on a pool of --threads threads,\n"
+		<< "                       against one thread per task\n"
+		<< "  --tasks=N            tasks of the --coroutines workload (default 1000)\n"
+		<< "\n"
+		<< "Critical section (lock workload):\n"
+		<< "  --cs-bytes=N         bytes touched, a multiple of 4 (default 64)\n"
+		<< "  --cs-stride=N        bytes from one touched int to the next (default 262144)\n"
+		<< "  --cs-write-percent=N share of the touched ints written, the rest are read (default 100)\n"
+		<< "  --lock-layout=MODE   padded: lock in a cache line of its own (default),\n"
+		<< "                       shared: data right after the lock word\n"
+		<< "\n"
+		<< "Instrumentation:\n"
+		<< "  --throughput         aggregate and per-thread acquisitions per second\n"
+		<< "  --latency            per-acquisition wait percentiles\n"
+		<< "  --fairness           per-thread completion, streaks and Jain's index\n"
+		<< "  --perf               hardware/software performance counters\n"
+		<< "\n"
+		<< "Placement:\n"
+		<< "  --placement=MODE     none, compact, scatter, smt or socket\n"
+		<< "  --cohort-nodes=N     virtual NUMA nodes for CohortLock (0: the real ones)\n"
+		<< "\n"
+		<< "Oversubscription:\n"
+		<< "  --oversubscribe[=LIST] threads per CPU instead of --threads (default 1,2,4,8);\n"
+		<< "                       without --locks, runs Futex<0>, Futex<1>, Futex<40> and std::mutex\n"
+		<< "  --cpus=N             keep the process on N CPUs (Linux only)\n"
+		<< "  --hogs=N             N background threads burning CPU during the measures\n"
+		<< "\n"
+		<< "  --list-locks         print the available lock names\n"
+		<< "  --check              check the timed locking paths and exit\n"
+		<< "  --help               this text\n";
+}
+
+
+inline std::vector<std::string> split_list(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::istringstream in(list);
+	std::string item;
+	while (std::getline(in, item, ',')) {
+		if (!item.empty()) {
+			items.push_back(item);
+		}
+	}
+	return items;
+}
+
+
+inline int parse_positive(const std::string& text, const char* what)
+{
+	size_t used = 0;
+	int value = std::stoi(text, &used);
+	if (used != text.size() || value < 1) {
+		throw std::invalid_argument(std::string("invalid ") + what + " \"" + text + "\"");
+	}
+	return value;
+}
+
+
+// Comma separated list of N, FIRST-LAST or FIRST-LAST:STEP items.
+inline std::vector<int> parse_thread_list(const std::string& list)
+{
+	std::vector<int> threads;
+	for (const auto& item: split_list(list)) {
+		auto dash = item.find('-');
+		if (dash == std::string::npos) {
+			threads.push_back(parse_positive(item, "thread count"));
+			continue;
+		}
+
+		auto colon = item.find(':', dash);
+		int first = parse_positive(item.substr(0, dash), "thread count");
+		int last = parse_positive(item.substr(dash + 1, colon - dash - 1), "thread count");
+		int step = colon == std::string::npos ? 1 : parse_positive(item.substr(colon + 1), "thread step");
+		for (int count = first; count <= last; count += step) {
+			threads.push_back(count);
+		}
+	}
+	if (threads.empty()) {
+		throw std::invalid_argument("empty thread list");
+	}
+	return threads;
+}
+
+
+// Throws std::invalid_argument (or what std::stoi throws) on bad input.
+inline harness_options parse_command_line(int argc, char* argv[])
+{
+	harness_options options;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto eq = arg.find('=');
+		std::string name = arg.substr(0, eq);
+		std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		if (arg.compare(0, 2, "--") != 0) {
+			// Any non-option parameter asks for a dry run, as it always did.
+			options.dry_run = true;
+		}
+		else if (arg == "--help") {
+			options.help = true;
+		}
+		else if (arg == "--list-locks") {
+			options.list_locks = true;
+		}
+		else if (arg == "--check") {
+			options.check = true;
+		}
+		else if (arg == "--dry-run") {
+			options.dry_run = true;
+		}
+		else if (arg == "--throughput") {
+			options.throughput = true;
+		}
+		else if (arg == "--latency") {
+			options.latency = true;
+		}
+		else if (arg == "--fairness") {
+			options.fairness = true;
+		}
+		else if (arg == "--perf") {
+			options.perf = true;
+		}
+		else if (arg == "--rw") {
+			options.workload = Workload::READ_MOSTLY;
+		}
+		else if (arg == "--prodcons") {
+			options.workload = Workload::PRODUCER_CONSUMER;
+		}
+		else if (arg == "--pipeline") {
+			options.workload = Workload::PIPELINE;
+		}
+		else if (arg == "--coroutines") {
+			options.workload = Workload::COROUTINES;
+		}
+		else if (name == "--tasks") {
+			options.tasks = parse_positive(value, "task count");
+		}
+		else if (name == "--producers") {
+			options.producers = parse_positive(value, "producer count");
+		}
+		else if (name == "--queue-capacity") {
+			options.queue_capacity = parse_positive(value, "queue capacity");
+		}
+		else if (name == "--read-percent") {
+			size_t used = 0;
+			options.read_percent = std::stoi(value, &used);
+			if (used != value.size() || options.read_percent < 0 || options.read_percent > 100) {
+				throw std::invalid_argument("invalid read percentage \"" + value + "\"");
+			}
+		}
+		else if (name == "--cs-bytes" || name == "--cs-stride") {
+			int bytes = parse_positive(value, "byte count");
+			if (bytes % sizeof(int) != 0) {
+				throw std::invalid_argument(name + " must be a multiple of " + std::to_string(sizeof(int)));
+			}
+			(name == "--cs-bytes" ? options.cs_bytes : options.cs_stride) = bytes;
+		}
+		else if (name == "--cs-write-percent") {
+			size_t used = 0;
+			options.cs_write_percent = std::stoi(value, &used);
+			if (used != value.size() || options.cs_write_percent < 0 || options.cs_write_percent > 100) {
+				throw std::invalid_argument("invalid write percentage \"" + value + "\"");
+			}
+		}
+		else if (name == "--lock-layout") {
+			if (value == "padded" || value == "shared") {
+				options.lock_shares_line = value == "shared";
+			}
+			else {
+				throw std::invalid_argument("unknown lock layout \"" + value + "\" (use padded or shared)");
+			}
+		}
+		else if (name == "--threads") {
+			options.threads = parse_thread_list(value);
+		}
+		else if (name == "--iterations") {
+			size_t used = 0;
+			options.iterations = std::stoll(value, &used);
+			if (used != value.size() || options.iterations < 1) {
+				throw std::invalid_argument("invalid iteration count \"" + value + "\"");
+			}
+		}
+		else if (name == "--busy-loops") {
+			options.busy_loops.clear();
+			for (const auto& item: split_list(value)) {
+				size_t used = 0;
+				int loops = std::stoi(item, &used);
+				if (used != item.size() || loops < 0) {
+					throw std::invalid_argument("invalid busy loop count \"" + item + "\"");
+				}
+				options.busy_loops.push_back(loops);
+			}
+		}
+		else if (name == "--locks") {
+			options.locks = split_list(value);
+		}
+		else if (name == "--repeat") {
+			options.repeat = parse_positive(value, "repetition count");
+		}
+		else if (name == "--format") {
+			if (value == "csv") {
+				options.format = OutputFormat::CSV;
+			}
+			else if (value == "json") {
+				options.format = OutputFormat::JSON;
+			}
+			else {
+				throw std::invalid_argument("unknown format \"" + value + "\"");
+			}
+		}
+		else if (name == "--placement") {
+			if (!parse_placement(value, options.placement)) {
+				throw std::invalid_argument("unknown placement \"" + value
+						+ "\" (use none, compact, scatter, smt or socket)");
+			}
+		}
+		else if (name == "--oversubscribe") {
+			options.oversubscribe.clear();
+			for (const auto& item: split_list(eq == std::string::npos ? "1,2,4,8" : value)) {
+				options.oversubscribe.push_back(parse_positive(item, "threads per CPU"));
+			}
+			if (options.oversubscribe.empty()) {
+				throw std::invalid_argument("empty threads per CPU list");
+			}
+		}
+		else if (name == "--cpus") {
+			options.cpus = parse_positive(value, "CPU count");
+		}
+		else if (name == "--hogs") {
+			size_t used = 0;
+			options.hogs = std::stoi(value, &used);
+			if (used != value.size() || options.hogs < 0) {
+				throw std::invalid_argument("invalid hog count \"" + value + "\"");
+			}
+		}
+		else if (name == "--cohort-nodes") {
+			size_t used = 0;
+			options.cohort_nodes = std::stoi(value, &used);
+			if (used != value.size() || options.cohort_nodes < 0) {
+				throw std::invalid_argument("invalid node count \"" + value + "\"");
+			}
+		}
+		else {
+			throw std::invalid_argument("unknown option \"" + arg + "\"");
+		}
+	}
+	if (!options.oversubscribe.empty() && !options.threads.empty()) {
+		throw std::invalid_argument("--oversubscribe and --threads are mutually exclusive");
+	}
+	// The whole span gets allocated: keep it within 1 GiB.
+	if (static_cast<long long>(options.cs_bytes / sizeof(int) - 1) * options.cs_stride > (1LL << 30)) {
+		throw std::invalid_argument("critical section footprint too large (--cs-bytes x --cs-stride)");
+	}
+	return options;
+}
@@ -0,0 +1,95 @@
+/* A real futex: waiters park in the kernel instead of spinning.
+
+   This is the classic three-state mutex from Drepper's "Futexes Are Tricky":
+   the lock word is 0 when free, 1 when held and 2 when held with (possibly)
+   sleeping waiters. The uncontended paths are a single atomic instruction;
+   the syscall is only paid when someone actually had to wait.
+
+   Besides lock()/unlock() it has try_lock() and the timed try_lock_for()
+   and try_lock_until(), so it's a drop-in TimedLockable for
+   std::unique_lock and std::scoped_lock.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include "sys-futex.h"
+
+class ParkingFutex {
+   enum {
+      UNLOCKED=0,
+      LOCKED=1,
+      CONTENDED=2
+   };
+
+   std::atomic<int> m_state{UNLOCKED};
+
+public:
+   ParkingFutex() {}
+   ParkingFutex(const ParkingFutex& )= delete;
+   ParkingFutex(ParkingFutex&& )= delete;
+   ~ParkingFutex() {}
+
+   void lock() noexcept {
+      int state = UNLOCKED;
+      if (m_state.compare_exchange_strong(state, LOCKED,
+            std::memory_order_acquire,
+            std::memory_order_relaxed)) {
+         return;
+      }
+
+      // From here on we are a waiter: mark the lock as contended, so that
+      // the owner knows it has to wake someone up when it's done.
+      if (state != CONTENDED) {
+         state = m_state.exchange(CONTENDED, std::memory_order_acquire);
+      }
+      while (state != UNLOCKED) {
+         futex_wait(m_state, CONTENDED);
+         state = m_state.exchange(CONTENDED, std::memory_order_acquire);
+      }
+   }
+
+   bool try_lock() noexcept {
+      int state = UNLOCKED;
+      return m_state.compare_exchange_strong(state, LOCKED,
+            std::memory_order_acquire,
+            std::memory_order_relaxed);
+   }
+
+   // lock(), but parking with a timeout. Giving up leaves the word
+   // CONTENDED, which only costs the owner a useless wake.
+   template<class Clock, class Duration>
+   bool try_lock_until(const std::chrono::time_point<Clock, Duration>& deadline) noexcept {
+      int state = UNLOCKED;
+      if (m_state.compare_exchange_strong(state, LOCKED,
+            std::memory_order_acquire,
+            std::memory_order_relaxed)) {
+         return true;
+      }
+
+      if (state != CONTENDED) {
+         state = m_state.exchange(CONTENDED, std::memory_order_acquire);
+      }
+      while (state != UNLOCKED) {
+         auto remaining = deadline - Clock::now();
+         if (remaining <= Duration::zero()) {
+            return false;
+         }
+         futex_wait_for(m_state, CONTENDED, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+         state = m_state.exchange(CONTENDED, std::memory_order_acquire);
+      }
+      return true;
+   }
+
+   template<class Rep, class Period>
+   bool try_lock_for(const std::chrono::duration<Rep, Period>& timeout) noexcept {
+      return try_lock_until(std::chrono::steady_clock::now() + timeout);
+   }
+
+   void unlock() noexcept {
+      if (m_state.exchange(UNLOCKED, std::memory_order_release) != LOCKED) {
+         futex_wake(m_state, 1);
+      }
+   }
+};
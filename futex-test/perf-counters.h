@@ -0,0 +1,175 @@
+/* Hardware/software performance counters around a benchmark thread.
+
+   Uses perf_event_open(2) to count, for the calling thread only, the events
+   that explain why a lock scales (or doesn't): cycles, instructions, LLC
+   misses, context switches and CPU migrations.
+
+   Counters are often unavailable (containers, VMs without a virtual PMU,
+   perf_event_paranoid): each one that can't be opened is just reported as
+   invalid. If kernel-side counting is forbidden, hardware events fall back
+   to user-space only counting, and context switches to getrusage(); software
+   events have no user-space side. On other platforms nothing is counted.
+*/
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum {
+   PERF_COUNTER_COUNT=5
+};
+
+
+struct perf_sample
+{
+	std::array<long long, PERF_COUNTER_COUNT> values{};
+	std::array<bool, PERF_COUNTER_COUNT> valid{};
+
+	// Sums the counters; a counter is valid only if it was in both.
+	void merge(const perf_sample& other) noexcept {
+		for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+			values[i] += other.values[i];
+			valid[i] = valid[i] && other.valid[i];
+		}
+	}
+};
+
+
+class PerfCounters {
+   enum {
+      CONTEXT_SWITCHES=3
+   };
+
+   std::array<int, PERF_COUNTER_COUNT> m_fds;
+   // Fallback for the context switches counter.
+   long long m_switches_at_start{0};
+
+#if defined(__linux__)
+   struct event_id {
+      std::uint32_t type;
+      std::uint64_t config;
+   };
+
+   static constexpr std::array<event_id, PERF_COUNTER_COUNT> EVENTS{{
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      // The generic "cache misses" event maps to the last level cache.
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+   }};
+
+   static int open_event(const event_id& event, bool excludeKernel) noexcept {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = event.type;
+      attr.config = event.config;
+      attr.disabled = 1;
+      attr.exclude_kernel = excludeKernel;
+      attr.exclude_hv = 1;
+      // To scale the counts up if the PMU gets multiplexed.
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      // This thread, any CPU, no group.
+      return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+   }
+
+   static long long thread_switches() noexcept {
+      rusage usage;
+      if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+         return -1;
+      }
+      return usage.ru_nvcsw + usage.ru_nivcsw;
+   }
+#endif
+
+public:
+   // Opens the counters for the calling thread, stopped.
+   PerfCounters() {
+      m_fds.fill(-1);
+#if defined(__linux__)
+      for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+         m_fds[i] = open_event(EVENTS[i], false);
+         if (m_fds[i] < 0 && EVENTS[i].type == PERF_TYPE_HARDWARE) {
+            m_fds[i] = open_event(EVENTS[i], true);
+         }
+      }
+#endif
+   }
+
+   PerfCounters(const PerfCounters& )= delete;
+   PerfCounters(PerfCounters&& )= delete;
+
+   ~PerfCounters() {
+#if defined(__linux__)
+      for (int fd: m_fds) {
+         if (fd >= 0) {
+            close(fd);
+         }
+      }
+#endif
+   }
+
+   void start() noexcept {
+#if defined(__linux__)
+      for (int fd: m_fds) {
+         if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+         }
+      }
+      m_switches_at_start = thread_switches();
+#endif
+   }
+
+   void stop() noexcept {
+#if defined(__linux__)
+      for (int fd: m_fds) {
+         if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+         }
+      }
+#endif
+   }
+
+   perf_sample read() const noexcept {
+      perf_sample sample;
+#if defined(__linux__)
+      for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+         // value, time enabled, time running
+         std::uint64_t data[3];
+         if (m_fds[i] < 0 || ::read(m_fds[i], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data))) {
+            if (i == CONTEXT_SWITCHES && m_switches_at_start >= 0) {
+               sample.valid[i] = true;
+               sample.values[i] = thread_switches() - m_switches_at_start;
+            }
+            continue;
+         }
+         sample.valid[i] = true;
+         if (data[2] > 0 && data[2] < data[1]) {
+            sample.values[i] = static_cast<long long>(static_cast<double>(data[0]) * data[1] / data[2]);
+         }
+         else {
+            sample.values[i] = static_cast<long long>(data[0]);
+         }
+      }
+#endif
+      return sample;
+   }
+
+   static const char* name(int counter) noexcept {
+      static const char* const names[PERF_COUNTER_COUNT] = {
+         "Cycles", "Instructions", "LLC misses", "Context switches", "CPU migrations"
+      };
+      return names[counter];
+   }
+};
@@ -0,0 +1,225 @@
+/* CPU topology discovery and worker thread placement.
+
+   The topology comes from /sys/devices/system/cpu, restricted to the CPUs the
+   process is allowed to run on. A placement mode turns it into an ordered
+   list of CPUs, and worker i gets pinned to entry i (modulo the list size):
+
+   - compact: fill all the SMT siblings of a core, then the next core of the
+     same socket, then the next socket;
+   - scatter: one thread per socket, round robin, then per core; SMT siblings
+     are used only when every core already has a thread;
+   - smt: the SMT siblings of a single core only, so every handoff stays
+     within one core;
+   - socket: the first CPU of each socket only, so every handoff between
+     consecutive threads crosses the interconnect.
+
+   Placement is only supported on Linux; elsewhere the topology is empty and
+   the threads are left to the scheduler.
+*/
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#endif
+
+enum class Placement {
+   NONE,
+   COMPACT,
+   SCATTER,
+   SMT,
+   SOCKET
+};
+
+
+struct cpu_info
+{
+	int cpu;
+	int core;
+	int package;
+	int node;
+};
+
+
+inline const char* placement_name(Placement placement)
+{
+	switch (placement) {
+	case Placement::NONE: return "none";
+	case Placement::COMPACT: return "compact";
+	case Placement::SCATTER: return "scatter";
+	case Placement::SMT: return "smt";
+	case Placement::SOCKET: return "socket";
+	}
+	return "unknown";
+}
+
+
+inline bool parse_placement(const std::string& name, Placement& placement)
+{
+	for (Placement p: {Placement::NONE, Placement::COMPACT, Placement::SCATTER, Placement::SMT, Placement::SOCKET}) {
+		if (name == placement_name(p)) {
+			placement = p;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+#if defined(__linux__)
+inline int read_sys_int(const std::string& path, int fallback)
+{
+	std::ifstream in(path);
+	int value;
+	return (in >> value) ? value : fallback;
+}
+#endif
+
+
+// The CPUs this process may run on, sorted by (package, core, cpu).
+inline std::vector<cpu_info> read_cpu_topology()
+{
+	std::vector<cpu_info> cpus;
+#if defined(__linux__)
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		return cpus;
+	}
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed)) {
+			continue;
+		}
+		std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+		cpu_info info{cpu,
+			read_sys_int(base + "/topology/core_id", cpu),
+			read_sys_int(base + "/topology/physical_package_id", 0),
+			0};
+		// The NUMA node shows up as a nodeN link in the cpu directory.
+		struct stat st;
+		for (int node = 0; node < 64; ++node) {
+			if (stat((base + "/node" + std::to_string(node)).c_str(), &st) == 0) {
+				info.node = node;
+				break;
+			}
+		}
+		cpus.push_back(info);
+	}
+#endif
+	std::sort(cpus.begin(), cpus.end(), [](const cpu_info& a, const cpu_info& b) {
+		if (a.package != b.package) return a.package < b.package;
+		if (a.core != b.core) return a.core < b.core;
+		return a.cpu < b.cpu;
+	});
+	return cpus;
+}
+
+
+// Restricts the whole process to the first count CPUs it may run on (in
+// read_cpu_topology() order, so whole cores first). Threads started later
+// inherit the restriction. Returns false if that's not possible.
+inline bool restrict_process_cpus(int count)
+{
+#if defined(__linux__)
+	auto cpus = read_cpu_topology();
+	if (count < 1 || count > static_cast<int>(cpus.size())) {
+		return false;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int i = 0; i < count; ++i) {
+		CPU_SET(cpus[i].cpu, &set);
+	}
+	// Only the calling thread: call it before starting any other.
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	(void) count;
+	return false;
+#endif
+}
+
+
+// The order in which workers are assigned to CPUs; empty means "don't pin".
+inline std::vector<int> placement_order(Placement placement, const std::vector<cpu_info>& topology)
+{
+	std::vector<int> order;
+	if (placement == Placement::NONE || topology.empty()) {
+		return order;
+	}
+
+	// package -> core -> SMT siblings, all sorted.
+	std::map<int, std::map<int, std::vector<int>>> packages;
+	for (const auto& info: topology) {
+		packages[info.package][info.core].push_back(info.cpu);
+	}
+
+	switch (placement) {
+	case Placement::NONE:
+		break;
+
+	case Placement::COMPACT:
+		for (const auto& info: topology) {
+			order.push_back(info.cpu);
+		}
+		break;
+
+	case Placement::SCATTER: {
+		size_t max_cores = 0;
+		size_t max_siblings = 0;
+		for (const auto& package: packages) {
+			max_cores = std::max(max_cores, package.second.size());
+			for (const auto& core: package.second) {
+				max_siblings = std::max(max_siblings, core.second.size());
+			}
+		}
+		for (size_t sibling = 0; sibling < max_siblings; ++sibling) {
+			for (size_t core = 0; core < max_cores; ++core) {
+				for (const auto& package: packages) {
+					if (core >= package.second.size()) {
+						continue;
+					}
+					const auto& cpus = std::next(package.second.begin(), core)->second;
+					if (sibling < cpus.size()) {
+						order.push_back(cpus[sibling]);
+					}
+				}
+			}
+		}
+		break;
+	}
+
+	case Placement::SMT:
+		order = packages.begin()->second.begin()->second;
+		break;
+
+	case Placement::SOCKET:
+		for (const auto& package: packages) {
+			order.push_back(package.second.begin()->second.front());
+		}
+		break;
+	}
+	return order;
+}
+
+
+// Pins the calling thread; returns false if the OS refused (or can't).
+inline bool pin_current_thread(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void) cpu;
+	return false;
+#endif
+}
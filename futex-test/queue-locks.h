@@ -0,0 +1,172 @@
+/* Fair (FIFO) spin locks.
+
+   The plain Futex makes every waiter hammer the same cache line; here each
+   waiter gets in line and is handed the lock in arrival order.
+
+   - TicketLock: waiters still spin on a shared "now serving" counter, but
+     only read it, so the line is invalidated once per handoff.
+   - McsLock: each waiter spins on a flag in its own queue node, which is
+     flipped by its predecessor.
+   - ClhLock: each waiter spins on the node of its predecessor, which is
+     recycled as the waiter's own node after the release.
+
+   All of them satisfy the lock()/unlock() concept of std::lock_guard. Queue
+   nodes come from a per-thread pool, so MCS and CLH locks can be nested as
+   long as they're released in reverse acquisition order.
+*/
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "lock-utils.h"
+
+
+class TicketLock {
+   alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> m_next{0};
+   alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> m_serving{0};
+
+public:
+   TicketLock() {}
+   TicketLock(const TicketLock& )= delete;
+   TicketLock(TicketLock&& )= delete;
+   ~TicketLock() {}
+
+   void lock() noexcept {
+      unsigned int ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+      SpinWait spin;
+      while (m_serving.load(std::memory_order_acquire) != ticket) {
+         spin();
+      }
+   }
+
+   // Whether someone else is already in line; only meaningful for the owner.
+   bool has_waiters() const noexcept {
+      return m_next.load(std::memory_order_relaxed) - m_serving.load(std::memory_order_relaxed) > 1;
+   }
+
+   void unlock() noexcept {
+      // Only the owner writes m_serving, so a plain increment is fine.
+      m_serving.store(m_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+   }
+};
+
+
+struct alignas(CACHE_LINE_SIZE) QueueNode {
+   std::atomic<QueueNode*> next{nullptr};
+   std::atomic<bool> locked{false};
+};
+
+
+// Thread-local free list of queue nodes; allocates only when it runs dry.
+template<class Node>
+class NodePool {
+public:
+   static Node* acquire() {
+      auto& nodes = free_nodes();
+      if (nodes.empty()) {
+         return new Node;
+      }
+      Node* node = nodes.back().release();
+      nodes.pop_back();
+      return node;
+   }
+
+   static void release(Node* node) {
+      free_nodes().emplace_back(node);
+   }
+
+private:
+   static std::vector<std::unique_ptr<Node>>& free_nodes() {
+      thread_local std::vector<std::unique_ptr<Node>> nodes;
+      return nodes;
+   }
+};
+
+
+class McsLock {
+   alignas(CACHE_LINE_SIZE) std::atomic<QueueNode*> m_tail{nullptr};
+   // Written and read only by the current owner.
+   alignas(CACHE_LINE_SIZE) QueueNode* m_owner{nullptr};
+
+public:
+   McsLock() {}
+   McsLock(const McsLock& )= delete;
+   McsLock(McsLock&& )= delete;
+   ~McsLock() {}
+
+   void lock() noexcept {
+      QueueNode* node = NodePool<QueueNode>::acquire();
+      node->next.store(nullptr, std::memory_order_relaxed);
+      node->locked.store(true, std::memory_order_relaxed);
+
+      QueueNode* pred = m_tail.exchange(node, std::memory_order_acq_rel);
+      if (pred) {
+         pred->next.store(node, std::memory_order_release);
+         SpinWait spin;
+         while (node->locked.load(std::memory_order_acquire)) {
+            spin();
+         }
+      }
+      m_owner = node;
+   }
+
+   void unlock() noexcept {
+      QueueNode* node = m_owner;
+      QueueNode* next = node->next.load(std::memory_order_acquire);
+      if (!next) {
+         QueueNode* expected = node;
+         if (m_tail.compare_exchange_strong(expected, nullptr,
+               std::memory_order_release,
+               std::memory_order_relaxed)) {
+            NodePool<QueueNode>::release(node);
+            return;
+         }
+         // Someone swapped the tail but didn't link itself to us yet.
+         SpinWait spin;
+         while (!(next = node->next.load(std::memory_order_acquire))) {
+            spin();
+         }
+      }
+      next->locked.store(false, std::memory_order_release);
+      NodePool<QueueNode>::release(node);
+   }
+};
+
+
+class ClhLock {
+   alignas(CACHE_LINE_SIZE) std::atomic<QueueNode*> m_tail;
+   // Written and read only by the current owner.
+   alignas(CACHE_LINE_SIZE) QueueNode* m_owner{nullptr};
+   QueueNode* m_pred{nullptr};
+
+public:
+   ClhLock(): m_tail{new QueueNode} {}
+   ClhLock(const ClhLock& )= delete;
+   ClhLock(ClhLock&& )= delete;
+   // The tail node is the one released last, and nobody else references it.
+   ~ClhLock() { delete m_tail.load(); }
+
+   void lock() noexcept {
+      QueueNode* node = NodePool<QueueNode>::acquire();
+      node->locked.store(true, std::memory_order_relaxed);
+
+      QueueNode* pred = m_tail.exchange(node, std::memory_order_acq_rel);
+      SpinWait spin;
+      while (pred->locked.load(std::memory_order_acquire)) {
+         spin();
+      }
+      m_owner = node;
+      m_pred = pred;
+   }
+
+   void unlock() noexcept {
+      QueueNode* node = m_owner;
+      QueueNode* pred = m_pred;
+      // After this store the successor owns the lock (and m_owner/m_pred).
+      node->locked.store(false, std::memory_order_release);
+      // Our predecessor's node is now unreferenced; it becomes ours.
+      NodePool<QueueNode>::release(pred);
+   }
+};
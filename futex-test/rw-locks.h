@@ -0,0 +1,258 @@
+/* Reader-writer locks.
+
+   - RwSpinLock: readers share, writers exclude, everyone spins. A waiting
+     writer raises a pending flag that keeps new readers out, so a steady
+     stream of readers can't starve it. Writers count themselves while they
+     wait, so that the one getting in leaves the flag up for the others.
+   - ParkingRwLock: the same protocol, but waiters sleep on the lock word
+     through the futex; a waiters flag tells unlock whether to wake them.
+   - SeqLock: writers serialize on a sequence counter, readers don't write
+     anything at all: they read optimistically and retry if a writer got in
+     the way. It can't offer lock_shared(); readers use read_begin() and
+     read_retry() instead.
+
+   RwSpinLock and ParkingRwLock satisfy the SharedMutex concept, so they
+   work with std::shared_lock just like std::shared_mutex.
+*/
+#pragma once
+
+#include <atomic>
+#include <climits>
+
+#include "lock-utils.h"
+#include "sys-futex.h"
+
+
+class RwSpinLock {
+   enum {
+      WRITER=1,
+      PENDING=2,
+      READER=4
+   };
+
+   std::atomic<int> m_state{0};
+   // Writers inside lock(), including the one about to get the lock.
+   std::atomic<int> m_writers{0};
+
+public:
+   RwSpinLock() {}
+   RwSpinLock(const RwSpinLock& )= delete;
+   RwSpinLock(RwSpinLock&& )= delete;
+   ~RwSpinLock() {}
+
+   void lock() noexcept {
+      m_writers.fetch_add(1, std::memory_order_relaxed);
+      SpinWait spin;
+      for (;;) {
+         int state = m_state.load(std::memory_order_relaxed);
+         // No readers, no writer: take it, clearing the pending flag unless
+         // other writers still wait.
+         if ((state & ~PENDING) == 0) {
+            int pending = m_writers.load(std::memory_order_relaxed) > 1 ? PENDING : 0;
+            if (m_state.compare_exchange_weak(state, WRITER | pending,
+                  std::memory_order_acquire,
+                  std::memory_order_relaxed)) {
+               m_writers.fetch_sub(1, std::memory_order_relaxed);
+               return;
+            }
+            continue;
+         }
+         if (!(state & PENDING)) {
+            m_state.fetch_or(PENDING, std::memory_order_relaxed);
+         }
+         spin();
+      }
+   }
+
+   void unlock() noexcept {
+      // Keep the pending flag other writers may have raised meanwhile.
+      m_state.fetch_and(~WRITER, std::memory_order_release);
+   }
+
+   void lock_shared() noexcept {
+      SpinWait spin;
+      for (;;) {
+         int state = m_state.load(std::memory_order_relaxed);
+         if (!(state & (WRITER | PENDING))) {
+            if (m_state.compare_exchange_weak(state, state + READER,
+                  std::memory_order_acquire,
+                  std::memory_order_relaxed)) {
+               return;
+            }
+            continue;
+         }
+         spin();
+      }
+   }
+
+   void unlock_shared() noexcept {
+      m_state.fetch_sub(READER, std::memory_order_release);
+   }
+};
+
+
+class ParkingRwLock {
+   enum {
+      WRITER=1,
+      PENDING=2,
+      WAITERS=4,
+      READER=8,
+      SPIN_COUNT=0x40
+   };
+
+   std::atomic<int> m_state{0};
+   // Writers inside lock(), including the one about to get the lock.
+   std::atomic<int> m_writers{0};
+
+   static bool is_free(int state) noexcept {
+      return (state & ~(PENDING | WAITERS)) == 0;
+   }
+
+   // Sleeps until the state changes from the one given, raising the waiters
+   // flag first. Returns false if the state changed under our feet.
+   bool park(int state) noexcept {
+      if (!(state & WAITERS)) {
+         if (!m_state.compare_exchange_weak(state, state | WAITERS,
+               std::memory_order_relaxed,
+               std::memory_order_relaxed)) {
+            return false;
+         }
+         state |= WAITERS;
+      }
+      futex_wait(m_state, state);
+      return true;
+   }
+
+   // Called after a release: if the lock is now free and someone sleeps,
+   // wake everybody up and let them fight (readers may all get in at once).
+   // If someone else holds the lock already, their unlock will do it.
+   void wake_waiters() noexcept {
+      int state = m_state.load(std::memory_order_relaxed);
+      while ((state & WAITERS) && is_free(state)) {
+         if (m_state.compare_exchange_weak(state, state & ~WAITERS,
+               std::memory_order_relaxed,
+               std::memory_order_relaxed)) {
+            futex_wake(m_state, INT_MAX);
+            return;
+         }
+      }
+   }
+
+public:
+   ParkingRwLock() {}
+   ParkingRwLock(const ParkingRwLock& )= delete;
+   ParkingRwLock(ParkingRwLock&& )= delete;
+   ~ParkingRwLock() {}
+
+   void lock() noexcept {
+      m_writers.fetch_add(1, std::memory_order_relaxed);
+      int spins = 0;
+      for (;;) {
+         int state = m_state.load(std::memory_order_relaxed);
+         if (is_free(state)) {
+            // Keep the waiters flag: others may still be sleeping. Keep the
+            // pending flag too if some of them are writers.
+            int pending = m_writers.load(std::memory_order_relaxed) > 1 ? PENDING : 0;
+            if (m_state.compare_exchange_weak(state, WRITER | pending | (state & WAITERS),
+                  std::memory_order_acquire,
+                  std::memory_order_relaxed)) {
+               m_writers.fetch_sub(1, std::memory_order_relaxed);
+               return;
+            }
+            continue;
+         }
+         if (!(state & PENDING)) {
+            m_state.compare_exchange_weak(state, state | PENDING, std::memory_order_relaxed);
+            continue;
+         }
+         if (spins < SPIN_COUNT) {
+            ++spins;
+            cpu_relax();
+            continue;
+         }
+         park(state);
+      }
+   }
+
+   void unlock() noexcept {
+      m_state.fetch_and(~WRITER, std::memory_order_release);
+      wake_waiters();
+   }
+
+   void lock_shared() noexcept {
+      int spins = 0;
+      for (;;) {
+         int state = m_state.load(std::memory_order_relaxed);
+         if (!(state & (WRITER | PENDING))) {
+            if (m_state.compare_exchange_weak(state, state + READER,
+                  std::memory_order_acquire,
+                  std::memory_order_relaxed)) {
+               return;
+            }
+            continue;
+         }
+         if (spins < SPIN_COUNT) {
+            ++spins;
+            cpu_relax();
+            continue;
+         }
+         park(state);
+      }
+   }
+
+   void unlock_shared() noexcept {
+      if (m_state.fetch_sub(READER, std::memory_order_release) - READER < READER) {
+         // We were the last reader.
+         wake_waiters();
+      }
+   }
+};
+
+
+class SeqLock {
+   std::atomic<unsigned int> m_seq{0};
+
+public:
+   SeqLock() {}
+   SeqLock(const SeqLock& )= delete;
+   SeqLock(SeqLock&& )= delete;
+   ~SeqLock() {}
+
+   // Writers: an odd sequence means "write in progress" and excludes other
+   // writers as well.
+   void lock() noexcept {
+      SpinWait spin;
+      for (;;) {
+         unsigned int seq = m_seq.load(std::memory_order_relaxed);
+         if (!(seq & 1) && m_seq.compare_exchange_weak(seq, seq + 1,
+               std::memory_order_acquire,
+               std::memory_order_relaxed)) {
+            break;
+         }
+         spin();
+      }
+      // The data writes must not become visible before the odd sequence.
+      std::atomic_thread_fence(std::memory_order_release);
+   }
+
+   void unlock() noexcept {
+      m_seq.fetch_add(1, std::memory_order_release);
+   }
+
+   // Readers: read_begin(), read the data, and start over if read_retry()
+   // says a writer changed it meanwhile. The data must be read with (at
+   // least) relaxed atomic loads, as it may be concurrently written.
+   unsigned int read_begin() const noexcept {
+      SpinWait spin;
+      unsigned int seq;
+      while ((seq = m_seq.load(std::memory_order_acquire)) & 1) {
+         spin();
+      }
+      return seq;
+   }
+
+   bool read_retry(unsigned int seq) const noexcept {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return m_seq.load(std::memory_order_relaxed) != seq;
+   }
+};
@@ -0,0 +1,83 @@
+/* Thin portable wrapper around the OS "wait on address" primitive.
+
+   On Linux this is the futex(2) syscall; Windows offers the equivalent
+   WaitOnAddress/WakeByAddress pair. Elsewhere we fall back to a yield, which
+   keeps the callers correct (waits are allowed to return spuriously) but
+   obviously doesn't park anything.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#endif
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int) && std::atomic<int>::is_always_lock_free,
+              "futex words must be plain lock-free ints");
+
+// Sleeps while word == expected. May return spuriously: callers must re-check.
+inline void futex_wait(std::atomic<int>& word, int expected) noexcept
+{
+#if defined(__linux__)
+   syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+   WaitOnAddress(&word, &expected, sizeof(expected), INFINITE);
+#else
+   if (word.load(std::memory_order_relaxed) == expected) {
+      std::this_thread::yield();
+   }
+#endif
+}
+
+// Like futex_wait, but gives up after timeout. Callers tell a timeout from
+// a wakeup by looking at the clock.
+inline void futex_wait_for(std::atomic<int>& word, int expected, std::chrono::nanoseconds timeout) noexcept
+{
+   if (timeout <= std::chrono::nanoseconds::zero()) {
+      return;
+   }
+#if defined(__linux__)
+   struct timespec relative;
+   relative.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+   relative.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+   syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAIT_PRIVATE, expected, &relative, nullptr, 0);
+#elif defined(_WIN32)
+   // Rounded up, so that we don't wake up just before the deadline and spin.
+   auto millis = std::chrono::ceil<std::chrono::milliseconds>(timeout).count();
+   WaitOnAddress(&word, &expected, sizeof(expected),
+         millis >= INFINITE ? INFINITE - 1 : static_cast<DWORD>(millis));
+#else
+   if (word.load(std::memory_order_relaxed) == expected) {
+      std::this_thread::yield();
+   }
+#endif
+}
+
+// Wakes up to count threads sleeping on word.
+inline void futex_wake(std::atomic<int>& word, int count) noexcept
+{
+#if defined(__linux__)
+   syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+   if (count == 1) {
+      WakeByAddressSingle(&word);
+   }
+   else {
+      WakeByAddressAll(&word);
+   }
+#else
+   (void) word;
+   (void) count;
+#endif
+}
@@ -4,8 +4,520 @@
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <functional>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+#if defined(__GNUC__)
+#define popcount16(mask) __builtin_popcount(mask)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define popcount16(mask) __popcnt16(static_cast<unsigned short>(mask))
+#endif
+
+/**
+   Bulk zero-extension of contiguous code units, used when a string has to move
+   to a wider storage. Latin-1 code points are the byte values, UTF-16 code units
+   in a u16string are BMP code points, so widening is just zero-extending.
+
+   AVX2 when the compiler targets it (i.e. -march=native), SSE2 otherwise on x86,
+   and plain loops elsewhere and for the tails. Clearing vectorized_widening
+   leaves everything to the plain loops, so that the benchmark can time both
+   through the same adopt_model path.
+*/
+inline bool vectorized_widening = true;
+
+inline void widen_8_16( const uint8_t* src, char16_t* dst, size_t count ) {
+    size_t pos = 0;
+    if ( vectorized_widening ) {
+#if defined(__AVX2__)
+        for ( ; pos + 16 <= count; pos += 16 ) {
+            __m128i bytes = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src + pos) );
+            _mm256_storeu_si256( reinterpret_cast<__m256i*>(dst + pos), _mm256_cvtepu8_epi16( bytes ) );
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        const __m128i zero = _mm_setzero_si128();
+        for ( ; pos + 16 <= count; pos += 16 ) {
+            __m128i bytes = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src + pos) );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + pos), _mm_unpacklo_epi8( bytes, zero ) );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + pos + 8), _mm_unpackhi_epi8( bytes, zero ) );
+        }
+#endif
+    }
+    for ( ; pos < count; ++pos ) {
+        dst[pos] = src[pos];
+    }
+}
+
+inline void widen_8_32( const uint8_t* src, char32_t* dst, size_t count ) {
+    size_t pos = 0;
+    if ( vectorized_widening ) {
+#if defined(__AVX2__)
+        for ( ; pos + 8 <= count; pos += 8 ) {
+            __m128i bytes = _mm_loadl_epi64( reinterpret_cast<const __m128i*>(src + pos) );
+            _mm256_storeu_si256( reinterpret_cast<__m256i*>(dst + pos), _mm256_cvtepu8_epi32( bytes ) );
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        const __m128i zero = _mm_setzero_si128();
+        for ( ; pos + 16 <= count; pos += 16 ) {
+            __m128i bytes = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src + pos) );
+            __m128i low = _mm_unpacklo_epi8( bytes, zero );
+            __m128i high = _mm_unpackhi_epi8( bytes, zero );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + pos), _mm_unpacklo_epi16( low, zero ) );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + pos + 4), _mm_unpackhi_epi16( low, zero ) );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + pos + 8), _mm_unpacklo_epi16( high, zero ) );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + pos + 12), _mm_unpackhi_epi16( high, zero ) );
+        }
+#endif
+    }
+    for ( ; pos < count; ++pos ) {
+        dst[pos] = src[pos];
+    }
+}
+
+inline void widen_16_32( const char16_t* src, char32_t* dst, size_t count ) {
+    size_t pos = 0;
+    if ( vectorized_widening ) {
+#if defined(__AVX2__)
+        for ( ; pos + 8 <= count; pos += 8 ) {
+            __m128i units = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src + pos) );
+            _mm256_storeu_si256( reinterpret_cast<__m256i*>(dst + pos), _mm256_cvtepu16_epi32( units ) );
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        const __m128i zero = _mm_setzero_si128();
+        for ( ; pos + 8 <= count; pos += 8 ) {
+            __m128i units = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src + pos) );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + pos), _mm_unpacklo_epi16( units, zero ) );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + pos + 4), _mm_unpackhi_epi16( units, zero ) );
+        }
+#endif
+    }
+    for ( ; pos < count; ++pos ) {
+        dst[pos] = src[pos];
+    }
+}
+
+// Copies count code units from src to dst, which must not be narrower.
+inline void widen_chars( const void* src, size_t src_size, void* dst, size_t dst_size, size_t count ) {
+    if ( src_size == dst_size ) {
+        std::memcpy( dst, src, count * src_size );
+    }
+    else if ( src_size == 1 && dst_size == 2 ) {
+        widen_8_16( static_cast<const uint8_t*>(src), static_cast<char16_t*>(dst), count );
+    }
+    else if ( src_size == 1 && dst_size == 4 ) {
+        widen_8_32( static_cast<const uint8_t*>(src), static_cast<char32_t*>(dst), count );
+    }
+    else if ( src_size == 2 && dst_size == 4 ) {
+        widen_16_32( static_cast<const char16_t*>(src), static_cast<char32_t*>(dst), count );
+    }
+    else {
+        throw std::invalid_argument( "Cannot narrow the char size" );
+    }
+}
+
+/**
+   UTF-8 decoding in two passes: scan_utf8 validates the input and finds its
+   length and the char size it needs, so that the caller can allocate the final
+   storage once, then decode_utf8 decodes it. The scan never decodes: the length
+   is the count of non-continuation bytes and the char size follows from the
+   largest lead byte.
+
+   With SSSE3 (i.e. -march=native) the scan checks 16 bytes at a time with
+   the Keiser-Lemire lookup tables; otherwise runs of ASCII are skipped 16
+   bytes at a time with SSE2 and the rest is checked one sequence at a time.
+   Either way: no overlongs, surrogates or code points past U+10FFFF.
+*/
+inline size_t ascii_prefix( const uint8_t* src, size_t count ) {
+    size_t pos = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    for ( ; pos + 16 <= count; pos += 16 ) {
+        __m128i bytes = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src + pos) );
+        if ( _mm_movemask_epi8( bytes ) != 0 ) {
+            break;
+        }
+    }
+#endif
+    while ( pos < count && src[pos] < 0x80 ) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Decodes the multi-byte sequence at src; returns its length, 0 if it's invalid.
+inline size_t decode_utf8_sequence( const uint8_t* src, size_t count, uint32_t& value ) {
+    auto continued = [src](size_t pos) { return (src[pos] & 0xC0) == 0x80; };
+    uint8_t lead = src[0];
+    if ( lead < 0xC2 ) {
+        return 0;
+    }
+    if ( lead < 0xE0 ) {
+        if ( count < 2 || !continued(1) ) {
+            return 0;
+        }
+        value = (lead & 0x1FU) << 6 | (src[1] & 0x3FU);
+        return 2;
+    }
+    if ( lead < 0xF0 ) {
+        if ( count < 3 || !continued(1) || !continued(2) ) {
+            return 0;
+        }
+        value = (lead & 0x0FU) << 12 | (src[1] & 0x3FU) << 6 | (src[2] & 0x3FU);
+        return value < 0x800 || (value >= 0xD800 && value < 0xE000) ? 0 : 3;
+    }
+    if ( lead < 0xF5 ) {
+        if ( count < 4 || !continued(1) || !continued(2) || !continued(3) ) {
+            return 0;
+        }
+        value = (lead & 0x07U) << 18 | (src[1] & 0x3FU) << 12 | (src[2] & 0x3FU) << 6 | (src[3] & 0x3FU);
+        return value < 0x10000 || value > 0x10FFFF ? 0 : 4;
+    }
+    return 0;
+}
+
+// Checks the multi-byte sequence at src without decoding it; returns its length, 0 if it's invalid.
+inline size_t utf8_sequence_length( const uint8_t* src, size_t count ) {
+    auto continued = [src](size_t pos) { return (src[pos] & 0xC0) == 0x80; };
+    uint8_t lead = src[0];
+    if ( lead < 0xC2 ) {
+        return 0;
+    }
+    if ( lead < 0xE0 ) {
+        return count >= 2 && continued(1) ? 2 : 0;
+    }
+    if ( lead < 0xF0 ) {
+        // the second byte range rules out overlongs (E0) and surrogates (ED)
+        uint8_t low = lead == 0xE0 ? 0xA0 : 0x80;
+        uint8_t high = lead == 0xED ? 0x9F : 0xBF;
+        return count >= 3 && src[1] >= low && src[1] <= high && continued(2) ? 3 : 0;
+    }
+    if ( lead < 0xF5 ) {
+        // overlongs (F0) and code points past U+10FFFF (F4)
+        uint8_t low = lead == 0xF0 ? 0x90 : 0x80;
+        uint8_t high = lead == 0xF4 ? 0x8F : 0xBF;
+        return count >= 4 && src[1] >= low && src[1] <= high && continued(2) && continued(3) ? 4 : 0;
+    }
+    return 0;
+}
+
+// The narrowest char size for the code points a lead byte can start.
+inline size_t char_size_for_lead( uint8_t max_lead ) {
+    return max_lead >= 0xF0 ? 4 : max_lead >= 0xC4 ? 2 : 1;
+}
+
+// One sequence at a time; throws std::invalid_argument at the first bad byte.
+inline size_t scan_utf8_sequences( const uint8_t* src, size_t count, uint8_t& max_lead ) {
+    size_t length = 0;
+    size_t pos = 0;
+    while ( pos < count ) {
+        if ( src[pos] < 0x80 ) {
+            size_t ascii = ascii_prefix( src + pos, count - pos );
+            length += ascii;
+            pos += ascii;
+            continue;
+        }
+        size_t used = utf8_sequence_length( src + pos, count - pos );
+        if ( used == 0 ) {
+            throw std::invalid_argument( "Invalid UTF-8 at byte " + std::to_string( pos ) );
+        }
+        max_lead = std::max( max_lead, src[pos] );
+        ++length;
+        pos += used;
+    }
+    return length;
+}
+
+#if defined(__SSSE3__)
+/* Keiser & Lemire, "Validating UTF-8 in less than one instruction per byte":
+   each pair of adjacent bytes is classified with three 16 entries lookups (on
+   the high nibble of the first byte, its low nibble and the high nibble of the
+   second byte), whose AND flags every invalid two byte pattern. The 2nd/3rd
+   continuation bytes of 3 and 4 byte sequences are expected from the lead byte
+   two and three positions back. */
+class utf8_block_checker {
+public:
+    // Checks the next 16 bytes; returns the number of code points starting in them.
+    size_t check( __m128i input ) {
+        m_max_byte = _mm_max_epu8( m_max_byte, input );
+        if ( _mm_movemask_epi8( input ) == 0 ) {
+            // ASCII: only a sequence cut short by this block can be wrong
+            m_error = _mm_or_si128( m_error, m_incomplete );
+            m_incomplete = _mm_setzero_si128();
+        }
+        else {
+            __m128i prev1 = _mm_alignr_epi8( input, m_previous, 15 );
+            m_error = _mm_or_si128( m_error, check_multibyte_lengths( input, check_special_cases( input, prev1 ) ) );
+            // a lead byte in the last three positions waiting for its continuation bytes
+            const __m128i last_leads = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, -1, -1,
+                                                      -1, -1, -1, -1, -1, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1 );
+            m_incomplete = _mm_subs_epu8( input, last_leads );
+        }
+        m_previous = input;
+        // continuation bytes are 0x80..0xBF, -128..-65 as signed bytes
+        return popcount16( _mm_movemask_epi8( _mm_cmpgt_epi8( input, _mm_set1_epi8( -65 ) ) ) );
+    }
+
+    // Call after the last block, which must end with an ASCII byte.
+    bool valid() const {
+        return _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_or_si128( m_error, m_incomplete ), _mm_setzero_si128() ) ) == 0xFFFF;
+    }
+
+    uint8_t max_byte() const {
+        alignas(16) uint8_t bytes[16];
+        _mm_store_si128( reinterpret_cast<__m128i*>(bytes), m_max_byte );
+        return *std::max_element( bytes, bytes + 16 );
+    }
+
+private:
+    static constexpr uint8_t TOO_SHORT = 1 << 0;   // lead byte followed by a lead or ASCII byte
+    static constexpr uint8_t TOO_LONG = 1 << 1;    // ASCII byte followed by a continuation byte
+    static constexpr uint8_t OVERLONG_3 = 1 << 2;  // E0 80..9F
+    static constexpr uint8_t TOO_LARGE = 1 << 3;   // F4 90..BF, F5..FF
+    static constexpr uint8_t SURROGATE = 1 << 4;   // ED A0..BF
+    static constexpr uint8_t OVERLONG_2 = 1 << 5;  // C0 or C1
+    static constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+    static constexpr uint8_t OVERLONG_4 = 1 << 6;  // F0 80..8F
+    static constexpr uint8_t TWO_CONTS = 1 << 7;   // continuation byte followed by another one
+    static constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+    static __m128i lookup( __m128i table, __m128i nibbles ) { return _mm_shuffle_epi8( table, nibbles ); }
+    static __m128i high_nibbles( __m128i bytes ) { return _mm_and_si128( _mm_srli_epi16( bytes, 4 ), _mm_set1_epi8( 0x0F ) ); }
+
+    static __m128i check_special_cases( __m128i input, __m128i prev1 ) {
+        const __m128i byte_1_high = _mm_setr_epi8(
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            TOO_SHORT | OVERLONG_2,
+            TOO_SHORT,
+            TOO_SHORT | OVERLONG_3 | SURROGATE,
+            static_cast<char>(TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4) );
+        const __m128i byte_1_low = _mm_setr_epi8(
+            static_cast<char>(CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),
+            static_cast<char>(CARRY | OVERLONG_2),
+            static_cast<char>(CARRY),
+            static_cast<char>(CARRY),
+            static_cast<char>(CARRY | TOO_LARGE),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+            static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000) );
+        const __m128i byte_2_high = _mm_setr_epi8(
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4),
+            static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE),
+            static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+            static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT );
+        __m128i cases = _mm_and_si128( lookup( byte_1_high, high_nibbles( prev1 ) ),
+                                       lookup( byte_1_low, _mm_and_si128( prev1, _mm_set1_epi8( 0x0F ) ) ) );
+        return _mm_and_si128( cases, lookup( byte_2_high, high_nibbles( input ) ) );
+    }
+
+    // TWO_CONTS is expected exactly where a 3 or 4 byte sequence continues.
+    __m128i check_multibyte_lengths( __m128i input, __m128i special_cases ) const {
+        __m128i prev2 = _mm_alignr_epi8( input, m_previous, 14 );
+        __m128i prev3 = _mm_alignr_epi8( input, m_previous, 13 );
+        __m128i third_byte = _mm_subs_epu8( prev2, _mm_set1_epi8( 0xE0 - 0x80 ) );
+        __m128i fourth_byte = _mm_subs_epu8( prev3, _mm_set1_epi8( 0xF0 - 0x80 ) );
+        __m128i expected = _mm_and_si128( _mm_or_si128( third_byte, fourth_byte ), _mm_set1_epi8( -128 ) );
+        return _mm_xor_si128( expected, special_cases );
+    }
+
+    __m128i m_previous = _mm_setzero_si128();
+    __m128i m_error = _mm_setzero_si128();
+    __m128i m_incomplete = _mm_setzero_si128();
+    __m128i m_max_byte = _mm_setzero_si128();
+};
+#endif
+
+// Returns the number of code points; throws std::invalid_argument on bad input.
+inline size_t scan_utf8( const uint8_t* src, size_t count, size_t& char_size ) {
+#if defined(__SSSE3__)
+    utf8_block_checker checker;
+    size_t length = 0;
+    size_t pos = 0;
+    for ( ; pos + 16 <= count; pos += 16 ) {
+        length += checker.check( _mm_loadu_si128( reinterpret_cast<const __m128i*>(src + pos) ) );
+    }
+    // the tail, zero padded: a sequence cut short by the end shows up as TOO_SHORT
+    alignas(16) uint8_t tail[16] = {};
+    std::memcpy( tail, src + pos, count - pos );
+    length += checker.check( _mm_load_si128( reinterpret_cast<const __m128i*>(tail) ) ) - (16 - (count - pos));
+    if ( checker.valid() ) {
+        char_size = char_size_for_lead( checker.max_byte() );
+        return length;
+    }
+    // rescan one sequence at a time to report where it goes wrong
+#endif
+    uint8_t max_lead = 0;
+    size_t length_checked = scan_utf8_sequences( src, count, max_lead );
+    char_size = char_size_for_lead( max_lead );
+    return length_checked;
+}
+
+// Decodes input already checked by scan_utf8 into dst, wide enough for it.
+template<typename CharT>
+void decode_utf8( const uint8_t* src, size_t count, CharT* dst ) {
+    size_t pos = 0;
+    while ( pos < count ) {
+        if ( src[pos] < 0x80 ) {
+            size_t ascii = ascii_prefix( src + pos, count - pos );
+            if ( ascii < 16 ) {
+                std::copy( src + pos, src + pos + ascii, dst );
+            }
+            else {
+                widen_chars( src + pos, 1, dst, sizeof(CharT), ascii );
+            }
+            dst += ascii;
+            pos += ascii;
+        }
+        else if ( src[pos] < 0xE0 ) {
+            *dst++ = static_cast<CharT>((src[pos] & 0x1FU) << 6 | (src[pos + 1] & 0x3FU));
+            pos += 2;
+        }
+        else if ( src[pos] < 0xF0 ) {
+            *dst++ = static_cast<CharT>((src[pos] & 0x0FU) << 12 | (src[pos + 1] & 0x3FU) << 6 | (src[pos + 2] & 0x3FU));
+            pos += 3;
+        }
+        else {
+            *dst++ = static_cast<CharT>((src[pos] & 0x07U) << 18 | (src[pos + 1] & 0x3FU) << 12
+                                        | (src[pos + 2] & 0x3FU) << 6 | (src[pos + 3] & 0x3FU));
+            pos += 4;
+        }
+    }
+}
+
+/**
+   UTF-8 encoding of contiguous code units, in one block. utf8_length gives the
+   exact output size, so that the caller can size the buffer once. Blocks of 16
+   ASCII code units are narrowed and stored with SSE2: any wider unit is turned
+   into 0x80 before the packs, as their signed saturation would zero some of
+   them (0x8000 and up), so it shows up in the sign bits. The rest goes one char
+   at a time.
+*/
+inline size_t encode_utf8_char( char* out, uint32_t value ) {
+    if ( value < 0x80 ) {
+        out[0] = static_cast<char>(value);
+        return 1;
+    }
+    if ( value < 0x800 ) {
+        out[0] = static_cast<char>(0xC0 | (0x1F & value >> 6));
+        out[1] = static_cast<char>(0x80 | (0x3F & value));
+        return 2;
+    }
+    if ( value < 0x10000 ) {
+        out[0] = static_cast<char>(0xE0 | (0xF & value >> 12));
+        out[1] = static_cast<char>(0x80 | (0x3F & value >> 6));
+        out[2] = static_cast<char>(0x80 | (0x3F & value));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xF0 | (0x7 & value >> 18));
+    out[1] = static_cast<char>(0x80 | (0x3F & value >> 12));
+    out[2] = static_cast<char>(0x80 | (0x3F & value >> 6));
+    out[3] = static_cast<char>(0x80 | (0x3F & value));
+    return 4;
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+inline __m128i load_ascii_block( const char* src ) {
+    return _mm_loadu_si128( reinterpret_cast<const __m128i*>(src) );
+}
+
+// Keeps the ASCII units, turns the others into 0x80.
+inline __m128i flag_wide_units16( __m128i units ) {
+    __m128i ascii = _mm_cmpeq_epi16( _mm_and_si128( units, _mm_set1_epi16( static_cast<short>(0xFF80) ) ),
+                                     _mm_setzero_si128() );
+    return _mm_or_si128( _mm_and_si128( units, ascii ), _mm_andnot_si128( ascii, _mm_set1_epi16( 0x80 ) ) );
+}
+
+inline __m128i flag_wide_units32( __m128i units ) {
+    __m128i ascii = _mm_cmpeq_epi32( _mm_and_si128( units, _mm_set1_epi32( ~0x7F ) ), _mm_setzero_si128() );
+    return _mm_or_si128( _mm_and_si128( units, ascii ), _mm_andnot_si128( ascii, _mm_set1_epi32( 0x80 ) ) );
+}
+
+inline __m128i load_ascii_block( const char16_t* src ) {
+    const auto* units = reinterpret_cast<const __m128i*>(src);
+    return _mm_packus_epi16( flag_wide_units16( _mm_loadu_si128( units ) ),
+                             flag_wide_units16( _mm_loadu_si128( units + 1 ) ) );
+}
+
+inline __m128i load_ascii_block( const char32_t* src ) {
+    const auto* units = reinterpret_cast<const __m128i*>(src);
+    return _mm_packus_epi16( _mm_packs_epi32( flag_wide_units32( _mm_loadu_si128( units ) ),
+                                              flag_wide_units32( _mm_loadu_si128( units + 1 ) ) ),
+                             _mm_packs_epi32( flag_wide_units32( _mm_loadu_si128( units + 2 ) ),
+                                              flag_wide_units32( _mm_loadu_si128( units + 3 ) ) ) );
+}
+#endif
+
+// Copies the leading blocks of 16 ASCII code units; returns how many it did.
+template<typename CharT>
+size_t copy_ascii_blocks( const CharT* src, size_t count, char* out ) {
+    size_t pos = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    for ( ; pos + 16 <= count; pos += 16 ) {
+        __m128i bytes = load_ascii_block( src + pos );
+        if ( _mm_movemask_epi8( bytes ) != 0 ) {
+            break;
+        }
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(out + pos), bytes );
+    }
+#endif
+    return pos;
+}
+
+template<typename CharT>
+size_t utf8_length( const CharT* src, size_t count ) {
+    size_t length = count;
+    size_t pos = 0;
+    while ( pos < count ) {
+#if defined(__SSE2__) || defined(_M_X64)
+        if ( pos + 16 <= count && _mm_movemask_epi8( load_ascii_block( src + pos ) ) == 0 ) {
+            pos += 16;
+            continue;
+        }
+#endif
+        for ( size_t end = std::min( count, pos + 16 ); pos < end; ++pos ) {
+            uint32_t value = static_cast<std::make_unsigned_t<CharT>>(src[pos]);
+            length += (value >= 0x80) + (value >= 0x800) + (value >= 0x10000);
+        }
+    }
+    return length;
+}
+
+template<typename CharT>
+size_t encode_utf8_chars( const CharT* src, size_t count, char* out ) {
+    char* start = out;
+    size_t pos = 0;
+    while ( pos < count ) {
+        size_t ascii = copy_ascii_blocks( src + pos, count - pos, out );
+        pos += ascii;
+        out += ascii;
+        // Up to a block one char at a time, then try the fast path again.
+        for ( size_t end = std::min( count, pos + 16 ); pos < end; ++pos ) {
+            out += encode_utf8_char( out, static_cast<std::make_unsigned_t<CharT>>(src[pos]) );
+        }
+    }
+    return out - start;
+}
 
 /**
    String with variable internal storage size.
@@ -25,109 +537,239 @@
 class VariantString
 {
 public:
-    class StringConcept  {
+    /* The code units, in the narrowest width that fits them, with the width
+       tag inline: no heap hop to reach them, and no virtual call. Short
+       strings of any width live in a 24 bytes inline buffer (23 Latin-1,
+       11 UTF-16 or 5 UTF-32 chars, plus the terminating zero c_str() needs),
+       which holds the heap block pointer once they grow past it. Always
+       zero-terminated, like std::basic_string. */
+    class Storage {
     public:
-        virtual ~StringConcept() = default;
-        virtual size_t char_size() const = 0;
-        virtual size_t size() const = 0;
-        virtual void resize (size_t n) =0;
-        virtual void reserve (size_t n) =0;
-        virtual void clear() =0;
-        virtual const char* c_str() const =0;
-        // Follows std::string::at semantics (bounds checked)
-        virtual uint32_t at( size_t pos ) const = 0;
-        // Like the operator, but explicitly non-lvalue.
-        virtual uint32_t get_at( size_t pos ) const = 0;
-        virtual void set_at( size_t pos, uint32_t v ) = 0;
-        virtual void push_back( uint32_t v ) = 0;
-        virtual StringConcept* clone() const = 0;
-    };
+        static constexpr size_t INLINE_BYTES = 24;
 
-    template<typename BaseString>
-    class StringModel: public StringConcept {
-    public:
-        StringModel(): m_base( std::make_unique<BaseString>()  ) {}
-        StringModel(const StringModel& other): m_base{std::make_unique<BaseString>(*other.m_base)} {}
-        StringModel(StringModel&& other) noexcept: m_base{std::move(other.m_base)} {}
-        StringModel(const BaseString& source): m_base{std::make_unique<BaseString>(source)} {}
-        StringModel(BaseString* base): m_base{base} {}
-        virtual ~StringModel() = default;
-
-        virtual size_t char_size() const { return sizeof(typename BaseString::value_type); }
-        virtual size_t size() const { return m_base->size(); }
-        virtual void resize (size_t n) { return m_base->resize(n); }
-        virtual void reserve (size_t n) { return m_base->reserve(n); }
-        virtual void clear() { return m_base->clear(); }
-        virtual const char* c_str() const { return reinterpret_cast<const char *>(m_base->c_str()); }
-        virtual StringConcept* clone() const { return new StringModel(*this); }
-        virtual uint32_t at( size_t pos ) const { return static_cast<uint32_t>(m_base->at(pos)); }
-        virtual uint32_t get_at( size_t pos ) const { return static_cast<uint32_t>(m_base->at( pos )); }
-        virtual void set_at( size_t pos, uint32_t v ) { m_base->at(pos) = static_cast<typename BaseString::value_type>(v); }
-        virtual void push_back(uint32_t v) { m_base->push_back(static_cast<typename BaseString::value_type>(v)); }
-
-    private: 
-       std::unique_ptr<BaseString> m_base;
+        explicit Storage( size_t char_size=1 ): m_width(checked_width( char_size )) {}
+        Storage(const Storage& other): m_width(other.m_width) {
+            reserve( other.m_size );
+            std::memcpy( data(), other.data(), (other.m_size + 1) * m_width );
+            m_size = other.m_size;
+        }
+        Storage(Storage&& other) noexcept { take( other ); }
+        ~Storage() { release(); }
+
+        Storage& operator=(const Storage& other) {
+            if ( &other != this ) {
+                Storage copy(other);
+                release();
+                take( copy );
+            }
+            return *this;
+        }
+
+        Storage& operator=(Storage&& other) noexcept {
+            if ( &other != this ) {
+                release();
+                take( other );
+            }
+            return *this;
+        }
+
+        size_t char_size() const noexcept { return m_width; }
+        size_t size() const noexcept { return m_size; }
+        size_t capacity() const noexcept { return m_heap ? m_block.capacity : INLINE_BYTES / m_width - 1; }
+        const void* data() const noexcept { return m_heap ? m_block.units : m_inline; }
+        void* data() noexcept { return m_heap ? m_block.units : m_inline; }
+
+        // Calls f with the units, as a char*, char16_t* or char32_t* after the width.
+        template<typename F>
+        decltype(auto) visit( F&& f ) {
+            switch ( m_width ) {
+            case 1: return f( static_cast<char*>(data()) );
+            case 2: return f( static_cast<char16_t*>(data()) );
+            default: return f( static_cast<char32_t*>(data()) );
+            }
+        }
+
+        template<typename F>
+        decltype(auto) visit( F&& f ) const {
+            switch ( m_width ) {
+            case 1: return f( static_cast<const char*>(data()) );
+            case 2: return f( static_cast<const char16_t*>(data()) );
+            default: return f( static_cast<const char32_t*>(data()) );
+            }
+        }
+
+        void reserve( size_t n ) {
+            if ( n <= capacity() ) {
+                return;
+            }
+            if ( n >= UINT32_MAX ) {
+                throw std::length_error( "VariantString too long" );
+            }
+            void* units = ::operator new( (n + 1) * m_width );
+            std::memcpy( units, data(), (m_size + 1) * m_width );
+            release();
+            m_block = {units, n};
+            m_heap = true;
+        }
+
+        // New units are zeroes.
+        void resize( size_t n ) {
+            size_t old_size = m_size;
+            resize_for_overwrite( n );
+            if ( n > old_size ) {
+                std::memset( unit_address( old_size ), 0, (n - old_size) * m_width );
+            }
+        }
+
+        // Like resize, but leaves the new units for the caller to write.
+        void resize_for_overwrite( size_t n ) {
+            if ( n > capacity() ) {
+                reserve( std::max( n, capacity() * 2 ) );
+            }
+            m_size = static_cast<uint32_t>(n);
+            terminate();
+        }
+
+        // Keeps the buffer, like std::string.
+        void clear() noexcept {
+            m_size = 0;
+            terminate();
+        }
+
+        void push_back( uint32_t v ) {
+            if ( m_size == capacity() ) {
+                reserve( capacity() * 2 );
+            }
+            visit([this, v](auto* units) { units[m_size] = static_cast<std::remove_pointer_t<decltype(units)>>(v); });
+            ++m_size;
+            terminate();
+        }
+
+    private:
+        struct heap_block {
+            void* units;
+            size_t capacity;
+        };
+
+        static uint8_t checked_width( size_t char_size ) {
+            if ( char_size != 1 && char_size != 2 && char_size != 4 ) {
+                throw std::invalid_argument( "Unknown char size" );
+            }
+            return static_cast<uint8_t>(char_size);
+        }
+
+        char* unit_address( size_t pos ) noexcept { return static_cast<char*>(data()) + pos * m_width; }
+
+        void terminate() noexcept { std::memset( unit_address( m_size ), 0, m_width ); }
+
+        void release() noexcept {
+            if ( m_heap ) {
+                ::operator delete( m_block.units );
+            }
+        }
+
+        // Steals other's units, leaving it empty and inline.
+        void take( Storage& other ) noexcept {
+            m_size = other.m_size;
+            m_width = other.m_width;
+            m_heap = other.m_heap;
+            std::memcpy( m_inline, other.m_inline, INLINE_BYTES );
+            other.m_size = 0;
+            other.m_heap = false;
+            other.terminate();
+        }
+
+        uint32_t m_size{0};
+        uint8_t m_width{1};
+        bool m_heap{false};
+        union {
+            alignas(heap_block) unsigned char m_inline[INLINE_BYTES]{};
+            heap_block m_block;
+        };
     };
 
+    // plain chars are Latin-1 code points, not signed values
+    template<typename CharT>
+    static uint32_t code_point( CharT v ) { return static_cast<std::make_unsigned_t<CharT>>(v); }
+
     // Lambda used as template parameters with decltype!
     static constexpr auto incrementor = [](size_t a, size_t b) -> size_t{ return a + b; };
     static constexpr auto decrementor = [](size_t a, size_t b) -> size_t{ return a - b; };
 
+    /* Random access, but characters are computed on the fly, so they come by
+       value. That is fine for the C++20 random access iterator concept, but
+       the C++17 forward (and stronger) categories want a real reference, so
+       the legacy category is only input. The lambda only tags the type: it's
+       kept as a function pointer, as lambdas can't be assigned. */
     template<class VStr, class incrF>
     class iterator {
     public:
-        iterator(VStr& owner, incrF f, size_t pos=0) noexcept: m_owner(owner), m_pos(pos), m_incr(f) {}
-        iterator(const iterator& other) noexcept: m_owner(other.m_owner), m_pos(other.m_pos), m_incr(other.m_incr){}
+        // it-> on a computed character: points into a copy of it.
+        struct arrow_proxy {
+            uint32_t value;
+            const uint32_t* operator->() const noexcept { return &value; }
+        };
+
+        using iterator_category = std::input_iterator_tag;
+        using iterator_concept = std::random_access_iterator_tag;
+        using value_type = uint32_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = arrow_proxy;
+        using reference = uint32_t;
+
+        // Singular, as for any other container: only for assigning over.
+        iterator() noexcept: m_owner(nullptr), m_incr(nullptr) {}
+        iterator(VStr& owner, size_t (*incr)(size_t, size_t), size_t pos=0) noexcept: m_owner(&owner), m_pos(pos), m_incr(incr) {}
         iterator& operator++() { m_pos = m_incr(m_pos, 1); return *this; }
-        iterator& operator--() { m_pos = m_incr(m_pos, 1); return *this; }
-        uint32_t& operator*() { m_chr = m_owner.get_at(m_pos); return m_chr; }
-        iterator operator+(int count) const { return iterator(m_owner, m_incr, m_incr(m_pos, count)); }
-        iterator operator-(int count) const { return iterator(m_owner, m_incr, m_incr(m_pos, -count)); }
-        iterator operator+=(int count) { m_pos = m_incr(m_pos, count); return *this; }
-        iterator operator-=(int count) {m_pos = m_incr(m_pos, -count); return *this; }
-        bool operator==(const iterator& other) const { return other.m_pos == m_pos && &other.m_owner == &m_owner; }
-        bool operator<(const iterator& other) const { return other.m_pos < m_pos && &other.m_owner == &m_owner; }
+        iterator& operator--() { m_pos = m_incr(m_pos, -1); return *this; }
+        iterator operator++(int) { iterator old(*this); ++*this; return old; }
+        iterator operator--(int) { iterator old(*this); --*this; return old; }
+        uint32_t operator*() const { return m_owner->load_unchecked(m_pos); }
+        arrow_proxy operator->() const { return {**this}; }
+        uint32_t operator[](difference_type count) const { return *(*this + count); }
+        iterator operator+(difference_type count) const { return iterator(*m_owner, m_incr, m_incr(m_pos, count)); }
+        iterator operator-(difference_type count) const { return iterator(*m_owner, m_incr, m_incr(m_pos, -count)); }
+        friend iterator operator+(difference_type count, const iterator& it) { return it + count; }
+        iterator& operator+=(difference_type count) { m_pos = m_incr(m_pos, count); return *this; }
+        iterator& operator-=(difference_type count) { m_pos = m_incr(m_pos, -count); return *this; }
+        // How many steps from other to here, whichever way we go.
+        difference_type operator-(const iterator& other) const { return m_incr(0, m_pos) - m_incr(0, other.m_pos); }
+        bool operator==(const iterator& other) const { return other.m_pos == m_pos && other.m_owner == m_owner; }
         bool operator!=(const iterator& other) const {return ! (*this == other); }
+        bool operator<(const iterator& other) const { return *this - other < 0; }
+        bool operator>(const iterator& other) const { return other < *this; }
+        bool operator<=(const iterator& other) const { return !(other < *this); }
+        bool operator>=(const iterator& other) const { return !(*this < other); }
     private:
-        VStr& m_owner;
+        VStr* m_owner;
         size_t m_pos{0};
-        mutable uint32_t m_chr{0};
-        incrF m_incr;
+        size_t (*m_incr)(size_t, size_t);
     };
 
-    static StringConcept* make_properly_fitted_string(size_t char_size)
+    static Storage make_properly_fitted_string(size_t char_size)
     {
-        switch ( char_size ) {
-        case sizeof( uint32_t ) :
-            return new StringModel<std::u32string>;
-        case sizeof( uint16_t ) :
-            return new StringModel<std::u16string>;
-        case sizeof( char ) :
-            return new StringModel<std::string>;
-        }
-        throw std::invalid_argument( "Unknown char size" );
+        return Storage( char_size );
     }
 
-    void adopt_model(StringConcept* model) {
-        model->resize( m_string->size() );
-        for ( size_t pos = 0; pos < model->size(); ++pos ) {
-            model->set_at( pos, m_string->get_at( pos ) );
-        }
-        m_string.reset(model);
+    void adopt_model(Storage model) {
+        // Room for the character that made us widen, usually appended next.
+        model.reserve( std::max( m_string.capacity(), m_string.size() + 1 ) );
+        model.resize_for_overwrite( m_string.size() );
+        widen_chars( m_string.data(), m_string.char_size(), model.data(), model.char_size(), m_string.size() );
+        m_string = std::move(model);
     }
 
     void refit( size_t char_size ) {
-        if ( m_string->char_size() < char_size ) {
+        if ( this->char_size() < char_size ) {
             adopt_model(make_properly_fitted_string( char_size ));
         }
     }
 
     void refit_if_too_large( uint32_t char_value ) {
-        StringConcept* model = 0;
-        if ( char_value >= 0x10000U && m_string->char_size() < 4) {
+        if ( char_value >= 0x10000U && char_size() < 4) {
             adopt_model(make_properly_fitted_string( 4 ));
         }
-        else if(char_value >= 0x100U && m_string->char_size() < 2) {
+        else if(char_value >= 0x100U && char_size() < 2) {
             adopt_model(make_properly_fitted_string( 2 ));
         }
     }
@@ -157,11 +799,36 @@ public:
     template<typename CharT> 
     void copy_from_chars_inner( CharT* seq ) {
         while ( *seq ) {
-            m_string->push_back( *seq );
+            m_string.push_back( code_point( *seq ) );
             ++seq;
         }
     }
 
+    // Follows std::string::at semantics (bounds checked)
+    void check_position( size_t pos ) const {
+        if ( pos >= m_string.size() ) {
+            throw std::out_of_range( "VariantString position out of range" );
+        }
+    }
+
+    uint32_t load_at( size_t pos ) const {
+        check_position( pos );
+        return load_unchecked( pos );
+    }
+
+    uint32_t load_unchecked( size_t pos ) const {
+        return m_string.visit([pos](const auto* units) { return code_point(units[pos]); });
+    }
+
+    void store_at( size_t pos, uint32_t v ) {
+        check_position( pos );
+        m_string.visit([pos, v](auto* units) { units[pos] = static_cast<std::remove_pointer_t<decltype(units)>>(v); });
+    }
+
+    void append( uint32_t v ) {
+        m_string.push_back( v );
+    }
+
     template<typename CharT>
     void copy_from_chars( CharT* seq ) {
         refit(sizeof( CharT ));
@@ -175,33 +842,40 @@ public:
 
     friend std::ostream& operator<<(std::ostream& out, const VariantString& str);
 
-    std::unique_ptr<StringConcept> m_string;
+    Storage m_string;
 public:
-    VariantString(): m_string{std::make_unique<StringModel<std::string>>()} {}
-    VariantString(const VariantString& other): m_string{other.m_string->clone()} {}
+    VariantString() {}
+    VariantString(const VariantString& other): m_string{other.m_string} {}
     VariantString(VariantString&& other) noexcept: m_string{std::move(other.m_string)} {
         std::cout << "Move constructor called\n";
-        other.m_string = 0;
+        other.m_string = Storage();
     }
     VariantString(size_t prealloc, size_t char_size=1): 
         m_string{make_properly_fitted_string(char_size)} 
     {
-        m_string->reserve(prealloc);
+        reserve(prealloc);
     }
     ~VariantString() = default;
 
+    // Tag for the decoding constructor: VariantString(VariantString::from_utf8, bytes).
+    struct from_utf8_t { explicit from_utf8_t() = default; };
+    static constexpr from_utf8_t from_utf8{};
+
+    VariantString(from_utf8_t, std::string_view utf8) { assign_utf8( utf8 ); }
+
     template<typename CharT>
     VariantString(const CharT* s):
-        m_string{ std::make_unique<StringModel<std::basic_string<CharT>>>()}
+        m_string{sizeof(CharT)}
     {
         copy_from_chars(s);
     }
 
     template<typename CharT>
     VariantString(const std::basic_string<CharT>& s):
-        m_string{std::make_unique<StringModel<decltype(s)>>()}
+        m_string{sizeof(CharT)}
     {
-        *m_string = s;
+        m_string.resize( s.size() );
+        std::memcpy( m_string.data(), s.data(), s.size() * sizeof(CharT) );
     }
 
     // we offer the const interator only    
@@ -217,12 +891,41 @@ public:
     enum {npos = std::string::npos};
    
     // Usual denizens of std::string 
-    size_t size() const { return m_string->size(); }
-    size_t char_size() const { return m_string->char_size(); }
-    void resize( size_t n ) { m_string->resize( n ); }
-    void reserve( size_t n ) { m_string->reserve( n ); }
-    void clear() { return m_string->clear(); }
-    const char* c_str() const { return m_string->c_str(); }
+    size_t size() const { return m_string.size(); }
+    size_t char_size() const { return m_string.char_size(); }
+    void resize( size_t n ) { m_string.resize( n ); }
+    void reserve( size_t n ) { m_string.reserve( n ); }
+    void clear() { m_string.clear(); }
+    const char* c_str() const { return static_cast<const char*>(m_string.data()); }
+
+    /* Calls visitor once with the characters as a std::basic_string_view of
+       their actual type (char, char16_t or char32_t), so that algorithms run
+       straight on the storage, one instantiation per width. Returns what the
+       visitor returns, which must be the same type for every width. Plain
+       chars are Latin-1: compare them through code_point(). */
+    template<typename Visitor>
+    decltype(auto) visit( Visitor&& visitor ) const {
+        return m_string.visit([this, &visitor](const auto* units) -> decltype(auto) {
+            using CharT = std::remove_const_t<std::remove_pointer_t<decltype(units)>>;
+            return visitor( std::basic_string_view<CharT>( units, size() ) );
+        });
+    }
+
+    // Size of the string in UTF-8, in bytes.
+    size_t utf8_size() const {
+        return m_string.visit([this](const auto* units) { return utf8_length( units, size() ); });
+    }
+
+    // Writes utf8_size() bytes to out, without terminating zero; returns their count.
+    size_t encode_utf8( char* out ) const {
+        return m_string.visit([this, out](const auto* units) { return encode_utf8_chars( units, size(), out ); });
+    }
+
+    // Replaces the content of out with the UTF-8 encoding of the string.
+    void to_utf8( std::string& out ) const {
+        out.resize( utf8_size() );
+        encode_utf8( &out[0] );
+    }
 
     VariantString& operator=(const char* s)
     {
@@ -232,41 +935,64 @@ public:
         return *this;
     }
 
+    /* Decodes UTF-8 (the other assignments take bytes as Latin-1), picking the
+       narrowest char size that fits; throws std::invalid_argument, leaving the
+       string as it was, if the input isn't valid UTF-8. */
+    VariantString& assign_utf8( std::string_view utf8 ) {
+        const auto* bytes = reinterpret_cast<const uint8_t*>(utf8.data());
+        size_t fitted_size = 1;
+        size_t length = scan_utf8( bytes, utf8.size(), fitted_size );
+        auto decode = [&](Storage& storage) {
+            storage.resize( length );
+            storage.visit([&](auto* units) { decode_utf8( bytes, utf8.size(), units ); });
+        };
+        if ( char_size() == fitted_size ) {
+            // reuse the buffer we have
+            decode( m_string );
+        }
+        else {
+            Storage decoded = make_properly_fitted_string( fitted_size );
+            decode( decoded );
+            m_string = std::move(decoded);
+        }
+        return *this;
+    }
+
     VariantString& operator=( const VariantString& other ) {
         if(&other != this) {
-            m_string.reset(other.m_string->clone());
+            m_string = other.m_string;
         }
         return *this;
     }
     
     // chars are always fitting
-    void set_at(size_t pos, char chr) { m_string->set_at( pos, static_cast<uint32_t>(chr) ); }
+    void set_at(size_t pos, char chr) { store_at( pos, code_point(chr) ); }
 
     void set_at( size_t pos, uint32_t chr ) {
         refit_if_too_large( chr );
-        m_string->set_at( pos, static_cast<uint32_t>(chr) );
+        store_at( pos, chr );
     }
 
-    uint32_t get_at( size_t pos ) const { return m_string->get_at( pos ); }
+    uint32_t get_at( size_t pos ) const { return load_at( pos ); }
 
     void push_back( char c ) {
         // chars are always fitting
-        m_string->push_back( c ); 
+        append( code_point(c) ); 
     }
 
     void push_back(uint32_t chr) {
         refit_if_too_large( chr );
-        m_string->push_back( chr );
+        append( chr );
     }
 
     /* We offer only the const l-value version. */
     const uint32_t operator[]( size_t pos ) const {
-        return m_string->get_at( pos );
+        return load_at( pos );
     }
 
     /* We offer only the const l-value version. */
     const uint32_t at( size_t pos ) const {
-        return m_string->at( pos );
+        return load_at( pos );
     }
 
     template<typename StringT>
@@ -311,7 +1037,7 @@ public:
         if(len == 0) return "";
         if(len > size()) len = size() - pos;
 
-        VariantString nstr(len, m_string->char_size());
+        VariantString nstr(len, char_size());
         const_iterator iter = begin() + static_cast<int>(pos);
         const_iterator iend = begin() + static_cast<int>(pos+len);
         for(; iter != iend; ++iter) {nstr.push_back(*iter);}
@@ -320,10 +1046,9 @@ public:
 };
 
 std::ostream& operator<<(std::ostream& out, const VariantString& str) {
-    for(auto chr: str) {
-        VariantString::toUtf8(out, chr);
-    }
-    return out;
+    std::string utf8;
+    str.to_utf8(utf8);
+    return out.write(utf8.data(), utf8.size());
 }
 
    
@@ -351,7 +1076,321 @@ VariantString trivial_pass(VariantString a)
     return a;
 }
 
-int main() {
+// Best of a few rounds, in GB/s for the given number of bytes.
+template<typename Work>
+double best_rate( size_t bytes, Work work ) {
+    double best = 0.0;
+    for ( int round = 0; round < 5; ++round ) {
+        auto start = std::chrono::steady_clock::now();
+        work();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max( best, bytes / elapsed.count() / 1e9 );
+    }
+    return best;
+}
+
+/**
+   Widening through push_back of a wider character, which makes adopt_model
+   widen the whole string: with the plain loops, then with the SSE2/AVX2 ones.
+   The payload is cut in strings of 16K characters, widened one at a time, so
+   that the allocator keeps recycling the same buffers and page faults on
+   fresh memory don't swamp the copy. Only the push_back is timed.
+*/
+double widening_rate( const std::vector<VariantString>& sources, uint32_t wide_char, size_t bytes, bool vectorized ) {
+    vectorized_widening = vectorized;
+    double best = 0.0;
+    for ( int round = 0; round < 5; ++round ) {
+        std::chrono::duration<double> elapsed{0};
+        for ( const auto& source: sources ) {
+            VariantString str( source );
+            auto start = std::chrono::steady_clock::now();
+            str.push_back( wide_char );
+            elapsed += std::chrono::steady_clock::now() - start;
+
+            if ( str.size() != source.size() + 1 || str.get_at( source.size() ) != wide_char
+                 || str.get_at( source.size() / 2 ) != source.get_at( source.size() / 2 ) ) {
+                throw std::logic_error( "Widening mismatch" );
+            }
+        }
+        best = std::max( best, bytes / elapsed.count() / 1e9 );
+    }
+    vectorized_widening = true;
+    return best;
+}
+
+template<typename Source>
+void benchmark_widening_step( const Source& source, uint32_t wide_char ) {
+    const size_t chunk = 16 * 1024;
+    std::vector<VariantString> sources;
+    sources.reserve( (source.size() + chunk - 1) / chunk );
+    for ( size_t pos = 0; pos < source.size(); pos += chunk ) {
+        sources.emplace_back( source.substr( pos, chunk ) );
+    }
+    size_t src_size = sources.front().char_size();
+    size_t dst_size = wide_char >= 0x10000U ? 4 : 2;
+    const size_t bytes = source.size() * (src_size + dst_size);
+
+    double scalar = widening_rate( sources, wide_char, bytes, false );
+    double simd = widening_rate( sources, wide_char, bytes, true );
+    std::cout << src_size * 8 << " -> " << dst_size * 8 << ": "
+              << std::fixed << std::setprecision(2)
+              << scalar << " GB/s scalar, " << simd << " GB/s SIMD\n";
+}
+
+void benchmark_widening() {
+    const size_t length = 16 * 1024 * 1024;
+    std::string latin1;
+    std::u16string utf16;
+    for ( size_t pos = 0; pos < length; ++pos ) {
+        latin1.push_back( static_cast<char>(0x20 + pos % 0xE0) );
+        utf16.push_back( static_cast<char16_t>(0x20 + pos % 0xFFE0) );
+    }
+
+    std::cout << "Widening " << length << " chars with push_back, 16K at a time (bytes read + written)\n";
+    benchmark_widening_step( latin1, 0x4E16U );
+    benchmark_widening_step( latin1, 0x1F600U );
+    benchmark_widening_step( utf16, 0x1F600U );
+}
+
+// Building and dropping lots of short strings, a third of them widened to
+// UTF-16 by a CJK character.
+void benchmark_short_strings() {
+    const size_t count = 1000000;
+    const char* words[] = {"", "id", "name", "Hello!", "short string"};
+    std::vector<VariantString> strings;
+    strings.reserve( count );
+
+    auto start = std::chrono::steady_clock::now();
+    for ( size_t pos = 0; pos < count; ++pos ) {
+        strings.emplace_back( words[pos % 5] );
+        if ( pos % 3 == 0 ) {
+            strings.back().push_back( 0x4E16U );
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    size_t widened = std::count_if( strings.begin(), strings.end(),
+                                    [](const VariantString& str) { return str.char_size() > 1; } );
+    start = std::chrono::steady_clock::now();
+    strings.clear();
+    elapsed += std::chrono::steady_clock::now() - start;
+    std::cout << "Short strings: " << std::fixed << std::setprecision(1)
+              << elapsed.count() / count << " ns each, "
+              << sizeof(VariantString) << " bytes per string, "
+              << widened * 100 / count << "% widened\n";
+}
+
+/**
+   Decoding UTF-8 payloads into a new string with assign_utf8, against decoding
+   them by hand (without validation) and feeding the code points one push_back
+   at a time.
+*/
+// A few megabytes of UTF-8 text of each kind, by name.
+std::vector<std::pair<const char*, std::string>> utf8_payloads() {
+    const size_t repeat = 200000;
+    const std::pair<const char*, const char*> samples[] = {
+        {"ASCII", "The quick brown fox jumps over the lazy dog. "},
+        {"Latin-1", "Voix ambiguë d'un coeur qui au zéphyr préfère les jattes de kiwis. "},
+        {"CJK", "敏捷的棕色狐狸跳过了懒狗。いろはにほへと "},
+        {"Emoji", "Fox 🦊 jumps over dog 🐶. "},
+    };
+
+    std::vector<std::pair<const char*, std::string>> payloads;
+    for ( const auto& sample: samples ) {
+        std::string payload;
+        for ( size_t count = 0; count < repeat; ++count ) {
+            payload += sample.second;
+        }
+        payloads.emplace_back( sample.first, payload );
+    }
+    return payloads;
+}
+
+void benchmark_utf8_decoding() {
+    std::cout << "Decoding UTF-8 (input bytes)\n";
+    for ( const auto& [name, payload]: utf8_payloads() ) {
+        const auto* bytes = reinterpret_cast<const uint8_t*>(payload.data());
+
+        VariantString by_char;
+        double pushed = best_rate( payload.size(), [&]() {
+            by_char = VariantString();
+            for ( size_t pos = 0; pos < payload.size(); ) {
+                uint32_t value = bytes[pos];
+                size_t used = value < 0x80 ? 1 : decode_utf8_sequence( bytes + pos, payload.size() - pos, value );
+                by_char.push_back( value );
+                pos += used;
+            }
+        });
+        VariantString decoded;
+        double bulk = best_rate( payload.size(), [&]() {
+            decoded = VariantString();
+            decoded.assign_utf8( payload );
+        });
+
+        if ( decoded.size() != by_char.size() || decoded.char_size() != by_char.char_size() ) {
+            throw std::logic_error( "Decoding mismatch" );
+        }
+        for ( size_t pos = 0; pos < decoded.size(); ++pos ) {
+            if ( decoded.get_at( pos ) != by_char.get_at( pos ) ) {
+                throw std::logic_error( "Decoding mismatch" );
+            }
+        }
+        std::cout << std::setw(8) << name << ": " << std::fixed << std::setprecision(2)
+                  << pushed << " GB/s with push_back, " << bulk << " GB/s with assign_utf8\n";
+    }
+}
+
+/**
+   Writing strings out as UTF-8: a char at a time through the iterator and
+   toUtf8 (how operator<< used to do it), with operator<< and with to_utf8.
+*/
+void benchmark_utf8_encoding() {
+    std::cout << "Encoding UTF-8 (output bytes)\n";
+    for ( const auto& [name, payload]: utf8_payloads() ) {
+        VariantString str(VariantString::from_utf8, payload);
+        std::ostringstream by_char;
+        double per_char = best_rate( payload.size(), [&]() {
+            by_char.str( std::string() );
+            for ( auto chr: str ) {
+                VariantString::toUtf8( by_char, chr );
+            }
+        });
+        std::ostringstream streamed;
+        double stream = best_rate( payload.size(), [&]() {
+            streamed.str( std::string() );
+            streamed << str;
+        });
+        std::string encoded;
+        double bulk = best_rate( payload.size(), [&]() { str.to_utf8( encoded ); });
+
+        if ( encoded != payload || streamed.str() != payload || by_char.str() != payload ) {
+            throw std::logic_error( "Encoding mismatch" );
+        }
+        std::cout << std::setw(8) << name << ": " << std::fixed << std::setprecision(2)
+                  << per_char << " GB/s by char, " << stream << " GB/s with operator<<, "
+                  << bulk << " GB/s with to_utf8\n";
+    }
+}
+
+/**
+   Scanning strings of each width with the iterators and on the typed views
+   given by visit: counting spaces, finding the first '!' and an FNV-1a hash of
+   the code points.
+*/
+void benchmark_scanning() {
+    std::cout << "Scanning (characters), with iterators -> with visit\n";
+    for ( const auto& [name, payload]: utf8_payloads() ) {
+        VariantString str(VariantString::from_utf8, payload + "!");
+        size_t iterated_count = 0, visited_count = 0;
+        size_t iterated_find = 0, visited_find = 0;
+        uint64_t iterated_hash = 0, visited_hash = 0;
+
+        double iterated_search = best_rate( str.size() * 2, [&]() {
+            iterated_count = std::count( str.begin(), str.end(), ' ' );
+            iterated_find = std::find( str.begin(), str.end(), '!' ) - str.begin();
+        });
+        double visited_search = best_rate( str.size() * 2, [&]() {
+            str.visit([&](auto chars) {
+                visited_count = std::count( chars.begin(), chars.end(), ' ' );
+                visited_find = std::find( chars.begin(), chars.end(), '!' ) - chars.begin();
+            });
+        });
+        double iterated_hashing = best_rate( str.size(), [&]() {
+            iterated_hash = 14695981039346656037ULL;
+            for ( uint32_t chr: str ) {
+                iterated_hash = (iterated_hash ^ chr) * 1099511628211ULL;
+            }
+        });
+        double visited_hashing = best_rate( str.size(), [&]() {
+            visited_hash = str.visit([](auto chars) {
+                uint64_t hash = 14695981039346656037ULL;
+                for ( auto chr: chars ) {
+                    hash = (hash ^ VariantString::code_point( chr )) * 1099511628211ULL;
+                }
+                return hash;
+            });
+        });
+
+        if ( iterated_count != visited_count || iterated_find != visited_find || iterated_hash != visited_hash
+                || iterated_find != str.size() - 1 ) {
+            throw std::logic_error( "Scanning mismatch" );
+        }
+        std::cout << std::setw(8) << name << " (char-size " << str.char_size() << "): "
+                  << std::fixed << std::setprecision(2)
+                  << "count+find " << iterated_search << " -> " << visited_search << " G/s, "
+                  << "hash " << iterated_hashing << " -> " << visited_hashing << " G/s\n";
+    }
+}
+
+/**
+   UTF-8 round trips of strings whose blocks of 16 code units are wide all
+   the way through (every unit 0x8000 and up, or mixed with ASCII), on top of
+   plain ASCII and emoji ones: utf8_size, to_utf8 and operator<< against a
+   char by char encoding, then assign_utf8 back.
+*/
+template<typename CharT>
+void check_utf8_round_trip( const char* name, const std::basic_string<CharT>& units ) {
+    std::string expected;
+    for ( CharT unit: units ) {
+        char bytes[4];
+        expected.append( bytes, encode_utf8_char( bytes, static_cast<uint32_t>(unit) ) );
+    }
+
+    VariantString str( units );
+    std::string encoded;
+    str.to_utf8( encoded );
+    std::ostringstream streamed;
+    streamed << str;
+    if ( str.utf8_size() != expected.size() || encoded != expected || streamed.str() != expected ) {
+        throw std::logic_error( std::string( "UTF-8 encoding mismatch: " ) + name );
+    }
+
+    VariantString decoded;
+    decoded.assign_utf8( encoded );
+    bool same = decoded.size() == units.size();
+    for ( size_t pos = 0; same && pos < units.size(); ++pos ) {
+        same = decoded.get_at( pos ) == static_cast<uint32_t>(units[pos]);
+    }
+    if ( !same ) {
+        throw std::logic_error( std::string( "UTF-8 decoding mismatch: " ) + name );
+    }
+}
+
+void check_utf8_round_trips() {
+    auto repeat = [](auto unit, size_t count) { return std::basic_string<decltype(unit)>( count, unit ); };
+    std::u16string alternating;
+    for ( size_t pos = 0; pos < 8; ++pos ) {
+        alternating += u"a\uFF01";
+    }
+    std::u16string high_units;
+    for ( char16_t unit = 0x8000; unit < 0x8020; ++unit ) {
+        high_units.push_back( unit );
+    }
+
+    check_utf8_round_trip( "ASCII", repeat( u'a', 40 ) );
+    check_utf8_round_trip( "U+AC00 x20", repeat( u'\uAC00', 20 ) );
+    check_utf8_round_trip( "U+FF01 x16", repeat( u'\uFF01', 16 ) );
+    check_utf8_round_trip( "a U+FF01 x8", alternating );
+    check_utf8_round_trip( "U+8000..U+801F", high_units );
+    check_utf8_round_trip( "ASCII then U+AC00", repeat( u'a', 16 ) + repeat( u'\uAC00', 16 ) );
+    check_utf8_round_trip( "U+1F600 x16", repeat( U'\U0001F600', 16 ) );
+    check_utf8_round_trip( "U+FFFF x15 then a", repeat( U'\uFFFF', 15 ) + U"a" );
+    std::cout << "UTF-8 round trips: ok\n";
+}
+
+int main(int argc, char* argv[]) {
+    if ( argc > 1 && std::string(argv[1]) == "--check" ) {
+        check_utf8_round_trips();
+        return 0;
+    }
+    if ( argc > 1 && std::string(argv[1]) == "--bench" ) {
+        benchmark_widening();
+        benchmark_short_strings();
+        benchmark_utf8_decoding();
+        benchmark_utf8_encoding();
+        benchmark_scanning();
+        return 0;
+    }
+
     VariantString empty; // used for simpler output
     VariantString vs("Hello world!");
     std::cout << vs << '\n';
@@ -375,6 +1414,15 @@ int main() {
     utf_str2.set_at(16, 0x4E16U);
     utf_str2.set_at(17, 0x754CU);
     inspect_string(utf_str2);
+
+    VariantString decoded(VariantString::from_utf8, "Decoding: Hello 世界!");
+    inspect_string(decoded);
+    try {
+        decoded.assign_utf8("Broken: \xE4\xB8");
+    }
+    catch (const std::invalid_argument& e) {
+        std::cout << e.what() << "; kept: " << decoded << '\n';
+    }
     
     std::cout << "Pos access: " << empty + utf_str2[10] << ", "
               << empty + utf_str2[16] << ", "